@@ -0,0 +1,587 @@
+/*************************************************************************
+ *
+ *  emuFadc.c - Emulated fADC250s.
+ *
+ *  Each module makes its block from the event numbers and trigger
+ *  times of the next TI block when it is read, in the fADC250 data
+ *  format:
+ *
+ *    block header   0x80000000 | slot<<22 | 1<<18 | block number<<8 | level
+ *    event header   0x90000000 | slot<<22 | event number
+ *    trigger time   0x98000000 | time bits 23-0,  then  time bits 47-24
+ *    mode 1, 10:    window raw data header (type 4) and 2 samples per word
+ *    mode 9, 10:    pulse parameters (type 9): pedestal word, and
+ *                   2 words (integral, time/peak) per pulse up to NP
+ *    block trailer  0x88000000 | slot<<22 | words in the block
+ *    filler         0xF8000000 | slot<<22, to an even number of words
+ *
+ *  Pulses come at EMU_FADC_PULSES per channel and event.  A window has
+ *  the pedestal with noise and the shape of each pulse in it.
+ *
+ *************************************************************************/
+
+#include "emuLib.h"
+
+#define FA_NCH        16
+#define FA_SHAPE_LEN  32   /* Samples in the pulse shape */
+
+typedef struct
+{
+  int           slot;
+  int           mode;
+  unsigned int  PL, PTW, NSB, NSA, NP;
+  unsigned int  chmask;     /* Enabled channels */
+  int           berr;       /* Bus error ends the block transfer */
+  unsigned int  nread;      /* Blocks read */
+} emuFadc;
+
+int nfadc=0;
+int fadcA32Base=0x09000000;
+
+static emuFadc faMod[EMU_MAX_BOARD];
+static int faMultiBlock=0;
+static int faBlockError=0;
+static double faShape[FA_SHAPE_LEN];  /* Pulse shape, peak 1 */
+
+static emuFadc *
+faFind(int id)
+{
+  int ifa;
+
+  for(ifa = 0; ifa < nfadc; ifa++)
+    if(faMod[ifa].slot == id)
+      return &faMod[ifa];
+
+  printf("faLib: ERROR: No fADC250 in slot %d\n", id);
+  return NULL;
+}
+
+int
+faInit(unsigned int addr, unsigned int addr_inc, int nadc, int iFlag)
+{
+  int ifa, slot, isamp;
+  double x;
+
+  emuInit();
+
+  for(isamp = 0; isamp < FA_SHAPE_LEN; isamp++)
+    {
+      x = isamp/4.;
+      faShape[isamp] = x*exp(1. - x);
+    }
+
+  nfadc = 0;
+  if(nadc > EMU_MAX_BOARD)
+    nadc = EMU_MAX_BOARD;
+
+  for(ifa = 0; ifa < nadc; ifa++)
+    {
+      slot = (addr + ifa*addr_inc) >> 19;
+      if((slot < 2) || (slot > 21))
+	break;
+
+      memset(&faMod[nfadc], 0, sizeof(emuFadc));
+      faMod[nfadc].slot   = slot;
+      faMod[nfadc].mode   = 1;
+      faMod[nfadc].PL     = 50;
+      faMod[nfadc].PTW    = 50;
+      faMod[nfadc].NSB    = 3;
+      faMod[nfadc].NSA    = 6;
+      faMod[nfadc].NP     = 1;
+      faMod[nfadc].chmask = 0xffff;
+      faMod[nfadc].berr   = 1;
+      nfadc++;
+    }
+
+  printf("faInit: %d emulated fADC250s, first in slot %d\n", nfadc,
+	 nfadc ? faMod[0].slot : 0);
+
+  return OK;
+}
+
+int
+faSlot(unsigned int i)
+{
+  if(i >= nfadc)
+    return ERROR;
+
+  return faMod[i].slot;
+}
+
+unsigned int
+faScanMask()
+{
+  unsigned int mask = 0;
+  int ifa;
+
+  for(ifa = 0; ifa < nfadc; ifa++)
+    mask |= (1 << faMod[ifa].slot);
+
+  return mask;
+}
+
+int
+faSetProcMode(int id, int pmode, unsigned int PL, unsigned int PTW,
+	      unsigned int NSB, unsigned int NSA, unsigned int NP,
+	      unsigned int NPED, unsigned int MAXPED, unsigned int NSAT)
+{
+  emuFadc *fa = faFind(id);
+
+  if(fa == NULL)
+    return ERROR;
+
+  if((pmode != 1) && (pmode != 9) && (pmode != 10))
+    {
+      printf("%s: ERROR: Processing mode %d is not emulated\n", __func__, pmode);
+      return ERROR;
+    }
+
+  fa->mode = pmode;
+  fa->PL   = PL;
+  fa->PTW  = PTW & 0x1ff;
+  fa->NSB  = NSB;
+  fa->NSA  = NSA;
+  fa->NP   = (NP < 1) ? 1 : ((NP > 4) ? 4 : NP);
+
+  return OK;
+}
+
+int
+faGetProcMode(int id, int *pmode, unsigned int *PL, unsigned int *PTW,
+	      unsigned int *NSB, unsigned int *NSA, unsigned int *NP)
+{
+  emuFadc *fa = faFind(id);
+
+  if(fa == NULL)
+    return ERROR;
+
+  emuSct(3);
+  *pmode = fa->mode;
+  *PL    = fa->PL;
+  *PTW   = fa->PTW;
+  *NSB   = fa->NSB;
+  *NSA   = fa->NSA;
+  *NP    = fa->NP;
+
+  return OK;
+}
+
+/* type 0: enabled channels */
+int
+faGetChannelMask(int id, int type)
+{
+  emuFadc *fa = faFind(id);
+
+  if(fa == NULL)
+    return ERROR;
+
+  emuSct(1);
+  return fa->chmask;
+}
+
+/* Settings from a config file in the fadc250Config format.  Only the
+   settings that change the data are used (times in ns):
+     FADC250_SLOT     all | slot
+     FADC250_MODE     1 | 9 | 10
+     FADC250_W_OFFSET window latency
+     FADC250_W_WIDTH  window width
+     FADC250_NSB, FADC250_NSA, FADC250_NPEAK
+     FADC250_ADC_MASK 16 values, 1 = enabled */
+int
+fadc250Config(char *fname)
+{
+  FILE *f;
+  char line[1024], key[64];
+  int ifa, slot = 0, ich, val, mask[FA_NCH], n, pos;
+
+  if((fname == NULL) || (fname[0] == '\0'))
+    return 0;
+
+  if((f = fopen(fname, "r")) == NULL)
+    {
+      printf("%s: ERROR: Unable to open %s\n", __func__, fname);
+      return -1;
+    }
+
+  while(fgets(line, sizeof(line), f) != NULL)
+    {
+      if(sscanf(line, "%63s%n", key, &pos) != 1)
+	continue;
+
+      if(strcmp(key, "FADC250_SLOT") == 0)
+	{
+	  slot = (sscanf(line + pos, "%d", &val) == 1) ? val : 0;
+	  continue;
+	}
+
+      if(strcmp(key, "FADC250_ADC_MASK") == 0)
+	{
+	  for(ich = 0; ich < FA_NCH; ich++)
+	    {
+	      if(sscanf(line + pos, "%d%n", &mask[ich], &n) != 1)
+		break;
+	      pos += n;
+	    }
+	  if(ich < FA_NCH)
+	    continue;
+	  for(ifa = 0; ifa < nfadc; ifa++)
+	    if((slot == 0) || (faMod[ifa].slot == slot))
+	      for(faMod[ifa].chmask = 0, ich = 0; ich < FA_NCH; ich++)
+		if(mask[ich])
+		  faMod[ifa].chmask |= (1 << ich);
+	  continue;
+	}
+
+      if(sscanf(line + pos, "%d", &val) != 1)
+	continue;
+
+      for(ifa = 0; ifa < nfadc; ifa++)
+	{
+	  if((slot != 0) && (faMod[ifa].slot != slot))
+	    continue;
+
+	  if(strcmp(key, "FADC250_MODE") == 0)
+	    faMod[ifa].mode = val;
+	  else if(strcmp(key, "FADC250_W_OFFSET") == 0)
+	    faMod[ifa].PL = val/4;
+	  else if(strcmp(key, "FADC250_W_WIDTH") == 0)
+	    faMod[ifa].PTW = (val/4) & 0x1ff;
+	  else if(strcmp(key, "FADC250_NSB") == 0)
+	    faMod[ifa].NSB = val/4;
+	  else if(strcmp(key, "FADC250_NSA") == 0)
+	    faMod[ifa].NSA = val/4;
+	  else if(strcmp(key, "FADC250_NPEAK") == 0)
+	    faMod[ifa].NP = (val < 1) ? 1 : ((val > 4) ? 4 : val);
+	}
+    }
+  fclose(f);
+
+  return 0;
+}
+
+/*************************************************************************
+ *  Setup that has no effect on the emulated data
+ *************************************************************************/
+
+int
+faSetDAC(int id, unsigned short dvalue, unsigned short chmask)
+{
+  return OK;
+}
+
+int
+faSetThreshold(int id, unsigned short tvalue, unsigned short chmask)
+{
+  return OK;
+}
+
+int
+faResetMGT(int id, int reset)
+{
+  return OK;
+}
+
+int
+faSetTrigOut(int id, int trigout)
+{
+  return OK;
+}
+
+int
+faEnableSyncReset(int id)
+{
+  return OK;
+}
+
+int
+faGSetBlockLevel(int level)
+{
+  return OK;
+}
+
+int
+faEnableMultiBlock(int tflag)
+{
+  faMultiBlock = (nfadc > 1);
+  return OK;
+}
+
+int
+faDisableMultiBlock()
+{
+  faMultiBlock = 0;
+  return OK;
+}
+
+int
+faEnableBusError(int id)
+{
+  emuFadc *fa = faFind(id);
+
+  if(fa)
+    fa->berr = 1;
+  return OK;
+}
+
+int
+faDisableBusError(int id)
+{
+  emuFadc *fa = faFind(id);
+
+  if(fa)
+    fa->berr = 0;
+  return OK;
+}
+
+/* Start from the first block of the next run */
+static void
+faClear(emuFadc *fa)
+{
+  fa->nread = 0;
+}
+
+int
+faResetTriggerCount(int id)
+{
+  emuFadc *fa = faFind(id);
+
+  if(fa)
+    faClear(fa);
+  return OK;
+}
+
+int
+faSoftReset(int id, int cflag)
+{
+  return faResetTriggerCount(id);
+}
+
+int
+faGReset(int iFlag)
+{
+  int ifa;
+
+  for(ifa = 0; ifa < nfadc; ifa++)
+    faClear(&faMod[ifa]);
+  return OK;
+}
+
+int
+faGEnable(int eflag, int bank)
+{
+  faBlockError = 0;
+  return faGReset(0);
+}
+
+int
+faGDisable(int eflag)
+{
+  return OK;
+}
+
+/*************************************************************************
+ *  Readout
+ *************************************************************************/
+
+unsigned int
+faGBready()
+{
+  unsigned int done, mask = 0;
+  int ifa;
+
+  emuSct(nfadc);
+  done = emuBlocksDone();
+  for(ifa = 0; ifa < nfadc; ifa++)
+    if(faMod[ifa].nread < done)
+      mask |= (1 << faMod[ifa].slot);
+
+  return mask;
+}
+
+#define PUT(__w) { if(n < max) data[n] = LSWAP(__w); n++; }
+
+/* Block of fa for the TI block blk into data (at most max words).
+   Returns the words in the block, which may be more than max. */
+static int
+faBlockData(emuFadc *fa, emuBlock *blk, volatile unsigned int *data, int max)
+{
+  int n = 0, iev, ich, ip, npulse, isamp, s[2], ped;
+  unsigned int seed, slot = fa->slot << 22, evnum;
+  unsigned int t0[4], amp[4];
+  unsigned long long ts;
+
+  if((blk->rec >= 0) &&
+     ((n = emuReplayRead(blk->rec, EMU_REPLAY_FADC, fa - faMod, data, max)) > 0))
+    return n;
+
+  PUT(0x80000000 | slot | (1<<18) | ((blk->number & 0x3ff)<<8) | (blk->level & 0xff));
+
+  for(iev = 0; iev < blk->level; iev++)
+    {
+      evnum = blk->event + iev;
+      ts = blk->ts[iev];
+      seed = evnum*7919 + fa->slot + emuCfg.seed;
+
+      PUT(0x90000000 | slot | (evnum & 0x3fffff));
+      PUT(0x98000000 | (ts & 0xffffff));
+      PUT((ts >> 24) & 0xffffff);
+
+      for(ich = 0; ich < FA_NCH; ich++)
+	{
+	  if((fa->chmask & (1 << ich)) == 0)
+	    continue;
+
+	  ped = 100 + ich;
+	  npulse = emuPoisson(&seed, emuCfg.faPulses);
+	  if(npulse > 4)
+	    npulse = 4;
+	  for(ip = 0; ip < npulse; ip++)
+	    {
+	      t0[ip]  = fa->PTW ? emuRand(&seed) % fa->PTW : 0;
+	      amp[ip] = 50 + emuRand(&seed) % 3000;
+	    }
+
+	  if((fa->mode == 1) || (fa->mode == 10))
+	    {
+	      PUT(0xA0000000 | (ich<<23) | (fa->PTW & 0xfff));
+	      for(isamp = 0; isamp < fa->PTW; isamp += 2)
+		{
+		  for(ip = 0; ip < 2; ip++)
+		    {
+		      int k, x;
+
+		      s[ip] = ped + (emuRand(&seed) & 0x3) - 1;
+		      for(k = 0; k < npulse; k++)
+			{
+			  x = isamp + ip - t0[k];
+			  if((x >= 0) && (x < FA_SHAPE_LEN))
+			    s[ip] += (int)(amp[k]*faShape[x]);
+			}
+		      if(s[ip] > 4095)
+			s[ip] = 4095;
+		    }
+		  if(isamp + 1 == fa->PTW)
+		    s[1] = 0x2000;  /* Sample not valid */
+		  PUT(((s[0] & 0x3fff) << 16) | (s[1] & 0x3fff));
+		}
+	    }
+
+	  if(((fa->mode == 9) || (fa->mode == 10)) && (npulse > 0))
+	    {
+	      PUT(0xC8000000 | ((iev & 0xff)<<19) | (ich<<15) |
+		  ((ped*4) & 0x3fff));
+	      for(ip = 0; (ip < npulse) && (ip < fa->NP); ip++)
+		{
+		  PUT(0x40000000 | (((unsigned int)(amp[ip]*10.9) & 0x3ffff)<<12) |
+		      ((fa->NSB + fa->NSA) & 0x1ff));
+		  PUT(((t0[ip] + 4) & 0x1ff)<<21 | ((emuRand(&seed) & 0x3f)<<15) |
+		      ((ped + amp[ip]) & 0xfff));
+		}
+	    }
+	}
+    }
+
+  PUT(0x88000000 | slot | ((n + 1) & 0x3fffff));
+  if(n & 1)
+    PUT(0xF8000000 | slot);
+
+  return n;
+}
+
+/* rflag: 0 single cycles, 1 DMA, 2 multiblock DMA (from the first module) */
+int
+faReadBlock(int id, volatile unsigned int *data, int nwords, int rflag)
+{
+  emuFadc *fa = faFind(id);
+  emuBlock *blk;
+  int ifa, first, last, n, nblk, dummy = 0;
+
+  if((fa == NULL) || (data == NULL) || (nwords <= 0))
+    return ERROR;
+
+  first = fa - faMod;
+  last  = first;
+  if(rflag == 2)
+    {
+      if(!faMultiBlock || (first != 0))
+	{
+	  printf("%s: ERROR: Multiblock readout is not enabled for slot %d\n",
+		 __func__, id);
+	  return ERROR;
+	}
+      last = nfadc - 1;
+    }
+
+  /* The library reads one dummy word first if the destination is not
+     8-byte aligned for the DMA */
+  if((rflag > 0) && emuDmaMode64() && (((unsigned long)data) & 0x7))
+    {
+      *data++ = LSWAP(0xF800FAFA);
+      nwords--;
+      dummy = 1;
+    }
+
+  n = 0;
+  for(ifa = first; ifa <= last; ifa++)
+    {
+      blk = emuBlockGet(faMod[ifa].nread + 1);
+      if(blk == NULL)
+	{
+	  printf("%s: ERROR: Slot %d has no block ready\n", __func__, faMod[ifa].slot);
+	  faBlockError = 1;
+	  break;
+	}
+      faMod[ifa].nread++;
+
+      nblk = faBlockData(&faMod[ifa], blk, data + n, nwords - n);
+      if(n + nblk > nwords)
+	{
+	  printf("%s: ERROR: Block of slot %d (%d words) ends past the limit (%d)\n",
+		 __func__, faMod[ifa].slot, nblk, nwords - n);
+	  faBlockError = 1;
+	  n = nwords;
+	  break;
+	}
+      n += nblk;
+    }
+
+  if(rflag == 0)
+    emuSct(n);
+  else
+    emuDma(n);
+
+  return n + dummy;
+}
+
+int
+faGetBlockError(int pflag)
+{
+  int rval = faBlockError;
+
+  faBlockError = 0;
+  return rval;
+}
+
+int
+faGStatus(int sflag)
+{
+  int ifa;
+  emuFadc *fa;
+
+  printf("Emulated fADC250s (%s):\n", faMultiBlock ? "multiblock" : "single board");
+  for(ifa = 0; ifa < nfadc; ifa++)
+    {
+      fa = &faMod[ifa];
+      printf("  Slot %2d: mode %2d, PL %3u, PTW %3u, NSB %u, NSA %u, NP %u, channels 0x%04x, %u blocks read\n",
+	     fa->slot, fa->mode, fa->PL, fa->PTW, fa->NSB, fa->NSA, fa->NP,
+	     fa->chmask, fa->nread);
+    }
+
+  return OK;
+}
+
+int
+faSDC_Status(int sflag)
+{
+  return OK;
+}
@@ -0,0 +1,162 @@
+/*************************************************************************
+ *
+ *  emuLib.h - Emulation of the VME libraries used by the readout lists
+ *
+ *  libemu.so takes the place of the jvme, ti, fadc, vetroc, sd and
+ *  SIS3801 libraries on a Linux host with no VME crate.  It exports the
+ *  same functions the readout lists call, so a list built with the
+ *  usual headers from the linuxvme distribution links against it
+ *  unchanged (see Makefile: make LINUXVME_LIB=emu/lib ...).
+ *
+ *  Nothing is read from hardware.  The emulated TI accepts triggers at
+ *  a set rate, with the block level, buffer level, holdoff and block
+ *  limit the list programs, and keeps the event numbers and 48-bit
+ *  trigger times of every block.  The fADC250s and VETROCs make their
+ *  blocks of those events when they are read, in the data format of
+ *  the modules (fADC250 modes 1, 9 and 10, VETROC TDC hits).  The
+ *  SIS3801 fills its FIFO at a set rate.
+ *
+ *  Every call that reads a register on the real module waits
+ *  EMU_SCT_NS, and every block transfer waits EMU_DMA_SETUP_NS plus the
+ *  transfer time at the rate of the mode set by vmeDmaConfig(), so the
+ *  time spent in the readout is close to that of a real crate.
+ *
+ *  Settings (environment variables, read once):
+ *
+ *    EMU_TRIGGER_RATE   Trigger rate (Hz)                       10000
+ *    EMU_TRIGGER_FIXED  1: fixed period, 0: random (Poisson)        0
+ *    EMU_SCT_NS         Time of a VME single cycle (ns)          1000
+ *    EMU_DMA_SETUP_NS   Time to set up and end a DMA (ns)        8000
+ *    EMU_DMA_MBPS       DMA rate (MB/s), 0: from the DMA mode       0
+ *    EMU_FADC_PULSES    Mean pulses per fADC250 channel, event    0.2
+ *    EMU_VETROC_HITS    Mean hits per VETROC, event                 8
+ *    EMU_SCALER_RATE    SIS3801 FIFO entries per second           120
+ *    EMU_SIS3801_ADDR   SIS3801 A24 address                  0xa10000
+ *    EMU_SEED           Random seed                                 1
+ *    EMU_REPLAY         EVIO file to replay (see emuReplay.c)    (none)
+ *    EMU_REPLAY_SPEED   Replay this many times faster               1
+ *    EMU_REPLAY_LOOP    1: replay the file again when it ends        1
+ *    EMU_REPLAY_MAX     Blocks loaded from the file             20000
+ *    EMU_REPLAY_ROC     ROC bank to replay, 0: the first            0
+ *
+ *************************************************************************/
+
+#ifndef __EMULIB_H
+#define __EMULIB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "jvme.h"
+
+#define EMU_NBLOCK     1024  /* Blocks kept for the modules (power of 2) */
+#define EMU_MAX_LEVEL  255   /* Largest block level */
+#define EMU_MAX_BOARD  21    /* Modules of one type */
+
+typedef struct
+{
+  double        trigRate;
+  int           trigFixed;
+  unsigned int  sctNs;
+  unsigned int  dmaSetupNs;
+  double        dmaMBps;
+  double        faPulses;
+  double        vtHits;
+  double        scalRate;
+  unsigned int  sisAddr;
+  unsigned int  seed;
+  char         *replayFile;
+  double        replaySpeed;
+  int           replayLoop;
+  unsigned int  replayMax;
+  int           replayRoc;
+} emuConfig;
+
+/* A block of triggers, as the TI built it */
+typedef struct
+{
+  unsigned int        number;   /* Block number, from 1 */
+  int                 level;    /* Events in the block */
+  int                 sync;     /* Block ends with a sync event */
+  unsigned int        event;    /* Event number of the first event */
+  int                 rec;      /* Replayed record, -1 if none */
+  unsigned long long  ts[EMU_MAX_LEVEL];  /* Trigger times (4 ns ticks) */
+} emuBlock;
+
+/* Module banks of a replayed record */
+#define EMU_REPLAY_FADC    0
+#define EMU_REPLAY_VETROC  1
+#define EMU_REPLAY_NBANK   2
+
+extern emuConfig emuCfg;
+extern pthread_mutex_t emuMutex;
+
+/* emuVme.c */
+void emuInit();
+unsigned long long emuNow();
+void emuDelay(unsigned long long ns);
+void emuSct(int ncycle);
+void emuDma(int nwords);
+int  emuDmaMode64();
+void emuDmaSource(unsigned int addr, unsigned int size,
+		  int (*fill)(volatile unsigned int *data, unsigned int addr,
+			      int nbytes));
+
+/* emuTi.c */
+unsigned int emuBlocksDone();
+emuBlock *emuBlockGet(unsigned int number);
+
+/* emuReplay.c */
+extern int emuReplayOn;
+void emuReplayInit();
+int  emuReplayBlock(unsigned long long n, unsigned long long *t);
+int  emuReplayLevel(int rec);
+unsigned long long *emuReplayTimes(int rec);
+int  emuReplayModule(int rec, int ibank, int imod, unsigned int **data);
+int  emuReplayRead(int rec, int ibank, int imod, volatile unsigned int *data, int max);
+int  emuReplayScalers(int rec, unsigned int **data);
+
+/* emuSis3801.c */
+void emuSisPush(unsigned int *entry, int nentry);
+
+/* Random numbers, for the module data.  A plain LCG: cheap enough to
+   make every sample of a window without slowing the readout. */
+static inline unsigned int
+emuRand(unsigned int *seed)
+{
+  *seed = *seed*1103515245 + 12345;
+  return (*seed >> 16) & 0x7fff;
+}
+
+static inline double
+emuRandom(unsigned int *seed)
+{
+  return emuRand(seed) / 32768.;
+}
+
+static inline int
+emuPoisson(unsigned int *seed, double mean)
+{
+  double limit, prod;
+  int n = 0;
+
+  if(mean <= 0)
+    return 0;
+
+  if(mean > 30)  /* Near enough for this */
+    return (int)(mean + (emuRandom(seed) - 0.5)*2*sqrt(mean) + 0.5);
+
+  limit = exp(-mean);
+  prod = emuRandom(seed);
+  while(prod > limit)
+    {
+      n++;
+      prod *= emuRandom(seed);
+    }
+
+  return n;
+}
+
+#endif /* __EMULIB_H */
@@ -0,0 +1,487 @@
+/*************************************************************************
+ *
+ *  emuReplay.c - Recorded data in place of the emulated module data.
+ *
+ *  With EMU_REPLAY set to an EVIO (version 4) file, up to
+ *  EMU_REPLAY_MAX blocks of it are loaded at the first emuInit().  The
+ *  emulated TI then builds its blocks from the recorded ones, at the
+ *  recorded times (EMU_REPLAY_SPEED times faster), and the modules
+ *  return the recorded data of each block:
+ *
+ *    faReadBlock()      the fADC250 blocks of bank 3 (0xb0b0b0x5 first)
+ *    vetrocReadBlock()  the VETROC blocks of bank 4 (or 0xb0b0b0b4 first)
+ *    Read3801(), BLT    the SIS3801 FIFO entries of bank 6, which enter
+ *                       the FIFO at the time of their block
+ *
+ *  A recorded block that comes while the TI is busy is lost, as beam
+ *  triggers would be.  Its scaler entries are kept.  With EMU_REPLAY_LOOP
+ *  the blocks are replayed again from the first when they run out.
+ *
+ *  An event may be a ROC bank, as written by rocDriver, or a built event
+ *  holding several.  The ROC bank used is the first with a bank 3, 4 or
+ *  6 in it, or the one with tag EMU_REPLAY_ROC.  Trigger times are from
+ *  its TI trigger bank (0xFF10/0xFF11), or else from the timestamps of
+ *  the built trigger bank (0xFF21, 0xFF23, ...).  Without either, the
+ *  blocks come at EMU_TRIGGER_RATE.
+ *
+ *  Module blocks are found by their block header and trailer words, so
+ *  the word counts, markers and pad words of any bank 3/4 layout of
+ *  these lists are skipped.  A block without its header (the 0xb0b0b0b5
+ *  bank 3 of merge_vetroc_fadc_list.c writes a word count over it) is
+ *  not found.  The n-th module of the crate gets the n-th block of the
+ *  bank; the words are replayed as they were recorded.  A module with
+ *  no block in the record gets emulated data.
+ *
+ *************************************************************************/
+
+#include "emuLib.h"
+
+#define RP_EVIO_MAGIC  0xc0da0100
+#define RP_MAX_DEPTH   4
+
+typedef struct
+{
+  unsigned int  off;   /* In rpWord */
+  int           len;   /* Words */
+} rpChunk;
+
+typedef struct
+{
+  unsigned long long  t;       /* From the first block (ns) */
+  int                 level;
+  unsigned int        ts;      /* First in rpTs */
+  unsigned int        mod[EMU_REPLAY_NBANK];   /* First in rpChunk */
+  int                 nmod[EMU_REPLAY_NBANK];
+  unsigned int        sis;     /* First scaler word in rpWord */
+  int                 nsis;    /* Scaler entries */
+} rpRecord;
+
+int emuReplayOn=0;
+
+static unsigned int *rpWord=NULL;
+static unsigned int rpNword=0, rpMaxWord=0;
+static rpChunk *rpChunks=NULL;
+static unsigned int rpNchunk=0, rpMaxChunk=0;
+static unsigned long long *rpTs=NULL;
+static unsigned int rpNts=0, rpMaxTs=0;
+static rpRecord *rpRec=NULL;
+static unsigned int rpNrec=0;
+static unsigned long long rpSpan=0;  /* Time of one pass (ns) */
+
+/* Room for n more elements in a growing array */
+#define RP_GROW(__p, __n, __max, __more) {				\
+    if((__n) + (__more) > (__max))					\
+      {									\
+	(__max) = 2*((__n) + (__more));					\
+	(__p) = realloc((__p), (__max)*sizeof(*(__p)));			\
+	if((__p) == NULL)						\
+	  {								\
+	    perror("emuReplay: realloc");				\
+	    exit(1);							\
+	  }								\
+      }									\
+  }
+
+static int
+rpIsBankOfBanks(unsigned int header)
+{
+  int type = (header >> 8) & 0x3f;
+
+  return (type == 0x0e) || (type == 0x10);
+}
+
+static int
+rpIsSegments(unsigned int header)
+{
+  int type = (header >> 8) & 0x3f;
+
+  return (type == 0x0c) || (type == 0x20);
+}
+
+/* The bank at child lies inside its parent, which ends at end: it has
+   room for its two header words, and for all its length says.  A file
+   that fails this is cut short, or not EVIO. */
+static int
+rpInside(unsigned int *child, unsigned int *end)
+{
+  return ((end - child) >= 2) && (child[0] >= 1) &&
+    (child[0] < (unsigned int)(end - child));
+}
+
+/* The module blocks (block header to trailer and fillers) in data */
+static int
+rpModules(unsigned int *data, int n, int ibank, rpRecord *rec)
+{
+  int iw, start = -1;
+
+  rec->mod[ibank] = rpNchunk;
+  for(iw = 0; iw < n; iw++)
+    {
+      switch(data[iw] & 0xf8000000)
+	{
+	case 0x80000000:  /* Block header */
+	  start = iw;
+	  break;
+	case 0x88000000:  /* Block trailer */
+	  if(start < 0)
+	    break;
+	  while((iw + 1 < n) && ((data[iw+1] & 0xf8000000) == 0xf8000000) &&
+		(data[iw+1] != 0xf800fafa))
+	    iw++;
+	  RP_GROW(rpWord, rpNword, rpMaxWord, iw - start + 1);
+	  RP_GROW(rpChunks, rpNchunk, rpMaxChunk, 1);
+	  memcpy(&rpWord[rpNword], &data[start], (iw - start + 1)*4);
+	  rpChunks[rpNchunk].off = rpNword;
+	  rpChunks[rpNchunk].len = iw - start + 1;
+	  rpNword += iw - start + 1;
+	  rpNchunk++;
+	  start = -1;
+	  break;
+	}
+    }
+  rec->nmod[ibank] = rpNchunk - rec->mod[ibank];
+
+  return rec->nmod[ibank];
+}
+
+/* Scaler FIFO entries (0xb2b2b000|k, 32 words, 0xda0000aa) in data */
+static void
+rpScalers(unsigned int *data, int n, rpRecord *rec)
+{
+  int iw;
+
+  for(iw = 0; iw + 33 < n; iw++)
+    {
+      if(((data[iw] & 0xfffff000) != 0xb2b2b000) || (data[iw+33] != 0xda0000aa))
+	continue;
+      RP_GROW(rpWord, rpNword, rpMaxWord, 32);
+      memcpy(&rpWord[rpNword], &data[iw+1], 32*4);
+      rpNword += 32;
+      rec->nsis++;
+      iw += 33;
+    }
+}
+
+/* Trigger times of the TI bank (segments: event number, time bits
+   31-0, time bits 47-32) or of the built trigger bank (first segment:
+   64-bit first event number, then a 64-bit time per event) */
+static int
+rpTimes(unsigned int *bank, int level, int built)
+{
+  unsigned int *seg = bank + 2, *end = bank + bank[0] + 1;
+  int iev = 0, len;
+
+  if(seg >= end)
+    return 0;
+
+  RP_GROW(rpTs, rpNts, rpMaxTs, level);
+  if(built)
+    {
+      len = seg[0] & 0xffff;
+      if((((seg[0] >> 16) & 0x3f) != 0x0a) || (len < 2*(level + 1)) ||
+	 (len >= end - seg))
+	return 0;
+      for(iev = 0; iev < level; iev++)
+	rpTs[rpNts + iev] = (((unsigned long long)seg[3 + 2*iev]) << 32) | seg[4 + 2*iev];
+      return level;
+    }
+
+  while((seg < end) && (iev < level))
+    {
+      len = seg[0] & 0xffff;
+      if(len >= end - seg)
+	break;
+      if(len >= 3)
+	rpTs[rpNts + iev++] = (((unsigned long long)(seg[3] & 0xffff)) << 32) | seg[2];
+      seg += len + 1;
+    }
+
+  return (iev == level) ? level : 0;
+}
+
+/* The ROC bank in bank, and the built trigger bank beside it */
+static unsigned int *
+rpFindRoc(unsigned int *bank, int depth, unsigned int **trig)
+{
+  unsigned int *child, *end, *roc;
+  int tag;
+
+  if((depth > RP_MAX_DEPTH) || !rpIsBankOfBanks(bank[1]))
+    return NULL;
+
+  end = bank + bank[0] + 1;
+  for(child = bank + 2; rpInside(child, end); child += child[0] + 1)
+    {
+      tag = child[1] >> 16;
+      if(((tag == 3) || (tag == 4) || (tag == 6)) &&
+	 ((emuCfg.replayRoc == 0) || ((bank[1] >> 16) == emuCfg.replayRoc)))
+	return bank;
+    }
+
+  for(child = bank + 2; rpInside(child, end); child += child[0] + 1)
+    {
+      tag = child[1] >> 16;
+      if(((tag & 0xfff0) == 0xff20) && (tag & 1) && rpIsSegments(child[1]))
+	*trig = child;
+      else if((roc = rpFindRoc(child, depth + 1, trig)) != NULL)
+	return roc;
+    }
+
+  return NULL;
+}
+
+/* Add the block of one event */
+static void
+rpEvent(unsigned int *event)
+{
+  unsigned int *roc, *trig = NULL, *child, *end, *data;
+  int tag, n, level, ntime = 0;
+  rpRecord *rec;
+
+  roc = rpFindRoc(event, 0, &trig);
+  if(roc == NULL)
+    return;
+
+  rec = &rpRec[rpNrec];
+  memset(rec, 0, sizeof(rpRecord));
+  level = roc[1] & 0xff;
+  rec->level = (level < 1) ? 1 : ((level > EMU_MAX_LEVEL) ? EMU_MAX_LEVEL : level);
+  rec->ts = rpNts;
+
+  end = roc + roc[0] + 1;
+  for(child = roc + 2; rpInside(child, end); child += child[0] + 1)
+    {
+      tag  = child[1] >> 16;
+      data = child + 2;
+      n    = child[0] - 1;
+
+      if(((tag == 0xff10) || (tag == 0xff11)) && rpIsSegments(child[1]))
+	ntime = rpTimes(child, rec->level, 0);
+      else if((tag == 3) || (tag == 4))
+	{
+	  if((n > 0) && ((data[0] & 0xffffff0f) == 0xb0b0b004))
+	    rpModules(data, n, EMU_REPLAY_VETROC, rec);
+	  else if((n > 0) && ((data[0] & 0xffffff0f) == 0xb0b0b005))
+	    rpModules(data, n, EMU_REPLAY_FADC, rec);
+	  else
+	    rpModules(data, n, (tag == 3) ? EMU_REPLAY_FADC : EMU_REPLAY_VETROC, rec);
+	}
+      else if(tag == 6)
+	{
+	  rec->sis = rpNword;
+	  rpScalers(data, n, rec);
+	}
+    }
+
+  if((ntime == 0) && trig)
+    ntime = rpTimes(trig, rec->level, 1);
+  if(ntime)
+    rpNts += rec->level;
+  else
+    rec->ts = (unsigned int)-1;
+
+  rpNrec++;
+}
+
+/* Swap a block of the file to host order, if it was written the other
+   way */
+static void
+rpSwap(unsigned int *data, int n, int swap)
+{
+  int iw;
+
+  if(swap)
+    for(iw = 0; iw < n; iw++)
+      data[iw] = __builtin_bswap32(data[iw]);
+}
+
+/* Replay time of each record: its first trigger time, from the first
+   record, or the trigger rate if it has none */
+static void
+rpTimeline()
+{
+  unsigned long long t0 = 0, tlast = 0, t;
+  double step = (emuCfg.trigRate > 0) ? 1e9/emuCfg.trigRate : 1e5;
+  double speed = (emuCfg.replaySpeed > 0) ? emuCfg.replaySpeed : 1.;
+  unsigned int irec;
+  int first = 1;
+
+  for(irec = 0; irec < rpNrec; irec++)
+    {
+      if(rpRec[irec].ts != (unsigned int)-1)
+	{
+	  t = rpTs[rpRec[irec].ts];
+	  if(first)
+	    {
+	      t0 = t;
+	      first = 0;
+	    }
+	  /* 4 ns ticks.  A new run (or wrap) starts again from the last time. */
+	  if(t < t0)
+	    t0 = t - (tlast*speed)/4;
+	  rpRec[irec].t = (unsigned long long)((t - t0)*4/speed);
+	}
+      else
+	rpRec[irec].t = (irec ? tlast : 0) + (unsigned long long)(step*rpRec[irec].level);
+
+      if(rpRec[irec].t < tlast)
+	rpRec[irec].t = tlast;
+      tlast = rpRec[irec].t;
+    }
+
+  rpSpan = tlast + (rpNrec ? tlast/rpNrec : 0) + 1;
+}
+
+void
+emuReplayInit()
+{
+  FILE *f;
+  unsigned int head[8], *block = NULL, *grown, *event;
+  unsigned int nblock = 0, nevent = 0, maxblock = 0, len;
+  int swap, ievent;
+
+  f = fopen(emuCfg.replayFile, "r");
+  if(f == NULL)
+    {
+      perror(emuCfg.replayFile);
+      return;
+    }
+
+  rpRec = calloc(emuCfg.replayMax, sizeof(rpRecord));
+  if(rpRec == NULL)
+    {
+      perror("emuReplay: calloc");
+      fclose(f);
+      return;
+    }
+
+  while((rpNrec < emuCfg.replayMax) && (fread(head, 4, 8, f) == 8))
+    {
+      swap = (head[7] != RP_EVIO_MAGIC);
+      rpSwap(head, 8, swap);
+      if((head[7] != RP_EVIO_MAGIC) || ((head[5] & 0xff) != 4) ||
+	 (head[0] < head[2]) || (head[2] < 8))
+	{
+	  printf("emuReplay: %s: block %u is not an EVIO 4 block\n",
+		 emuCfg.replayFile, nblock);
+	  break;
+	}
+
+      len = head[0] - 8;
+      if(len > maxblock)
+	{
+	  grown = realloc(block, len*4ULL + 8);
+	  if(grown == NULL)
+	    {
+	      printf("emuReplay: %s: block %u: no memory for %u words\n",
+		     emuCfg.replayFile, nblock, len);
+	      break;
+	    }
+	  block = grown;
+	  maxblock = len;
+	}
+      if(fread(block, 4, len, f) != len)
+	break;
+      rpSwap(block, len, swap);
+      nblock++;
+
+      event = block + head[2] - 8;
+      for(ievent = 0; (ievent < head[3]) && (event < block + len) &&
+	    (rpNrec < emuCfg.replayMax); ievent++)
+	{
+	  if(!rpInside(event, block + len))
+	    break;
+	  rpEvent(event);
+	  nevent++;
+	  event += event[0] + 1;
+	}
+
+      if(head[5] & (1<<9))  /* Last block */
+	break;
+    }
+  fclose(f);
+  free(block);
+
+  if(rpNrec == 0)
+    {
+      printf("emuReplay: %s: No readout data found in %u events\n",
+	     emuCfg.replayFile, nevent);
+      return;
+    }
+
+  rpTimeline();
+  emuReplayOn = 1;
+
+  printf("emuReplay: %s: %u blocks from %u events, %u module blocks, %.3f s at speed %g%s\n",
+	 emuCfg.replayFile, rpNrec, nevent, rpNchunk, rpSpan*1e-9,
+	 emuCfg.replaySpeed, emuCfg.replayLoop ? ", looped" : "");
+}
+
+/* Replayed block n (from 0): its record, and when it comes (ns from the
+   start of the replay).  -1 when the replay is over. */
+int
+emuReplayBlock(unsigned long long n, unsigned long long *t)
+{
+  unsigned long long pass = n / rpNrec;
+
+  if(!emuReplayOn || (!emuCfg.replayLoop && (pass > 0)))
+    return -1;
+
+  *t = pass*rpSpan + rpRec[n % rpNrec].t;
+
+  return n % rpNrec;
+}
+
+int
+emuReplayLevel(int rec)
+{
+  return rpRec[rec].level;
+}
+
+/* Trigger times (4 ns ticks) of the record, NULL if it has none */
+unsigned long long *
+emuReplayTimes(int rec)
+{
+  return (rpRec[rec].ts == (unsigned int)-1) ? NULL : &rpTs[rpRec[rec].ts];
+}
+
+/* Block of module imod in bank ibank (EMU_REPLAY_FADC, _VETROC) of the
+   record.  Returns its words, 0 if it has none. */
+int
+emuReplayModule(int rec, int ibank, int imod, unsigned int **data)
+{
+  rpChunk *chunk;
+
+  if(imod >= rpRec[rec].nmod[ibank])
+    return 0;
+
+  chunk = &rpChunks[rpRec[rec].mod[ibank] + imod];
+  *data = &rpWord[chunk->off];
+
+  return chunk->len;
+}
+
+/* Copy the block of module imod into data (at most max words), as the
+   module would send it.  Returns the words in the block, 0 if the
+   record has none for this module. */
+int
+emuReplayRead(int rec, int ibank, int imod, volatile unsigned int *data, int max)
+{
+  unsigned int *src;
+  int iw, n;
+
+  n = emuReplayModule(rec, ibank, imod, &src);
+  for(iw = 0; (iw < n) && (iw < max); iw++)
+    data[iw] = LSWAP(src[iw]);
+
+  return n;
+}
+
+/* Scaler entries (32 words each) of the record */
+int
+emuReplayScalers(int rec, unsigned int **data)
+{
+  *data = &rpWord[rpRec[rec].sis];
+
+  return rpRec[rec].nsis;
+}
@@ -0,0 +1,44 @@
+/*************************************************************************
+ *
+ *  emuSd.c - Emulated Signal Distribution module.
+ *
+ *  The SD only routes the trigger, clock and busy signals, so there is
+ *  nothing to model.  The slot masks are kept for sdStatus().
+ *
+ *************************************************************************/
+
+#include "emuLib.h"
+
+static unsigned int sdActive=0;
+static unsigned int sdBusy=0;
+
+int
+sdInit(int iFlag)
+{
+  emuInit();
+  sdActive = sdBusy = 0;
+  return OK;
+}
+
+int
+sdSetActiveVmeSlots(unsigned int vmemask)
+{
+  emuSct(1);
+  sdActive = vmemask;
+  return OK;
+}
+
+int
+sdSetBusyVmeSlots(unsigned int vmemask, int pflag)
+{
+  emuSct(1);
+  sdBusy = pflag ? vmemask : (sdBusy | vmemask);
+  return OK;
+}
+
+int
+sdStatus(int pflag)
+{
+  printf("Emulated SD: active slots 0x%06x, busy slots 0x%06x\n", sdActive, sdBusy);
+  return OK;
+}
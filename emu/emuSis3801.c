@@ -0,0 +1,176 @@
+/*************************************************************************
+ *
+ *  emuSis3801.c - Emulated SIS3801 scaler.
+ *
+ *  From runStartClrSIS() the FIFO gains an entry of 32 channels every
+ *  1/EMU_SCALER_RATE s, up to SIS_FIFO_ENTRIES.  Channel 0 carries the
+ *  helicity pattern bits (24-31) over its count.  An entry is taken
+ *  from the FIFO with 32 Read3801() calls, or with one 128-byte block
+ *  transfer from the FIFO window (EMU_SIS3801_ADDR + 0x100).
+ *
+ *  In a replay (EMU_REPLAY) the FIFO gets the recorded entries instead,
+ *  from the emulated TI at the time of their block (emuSisPush()).
+ *
+ *************************************************************************/
+
+#include "emuLib.h"
+
+#define SIS_NCHAN         32
+#define SIS_FIFO_ENTRIES  2048
+#define SIS_COUNT_MASK    0x00ffffff
+
+static int sisRun=0;
+static unsigned long long sisStart=0;  /* Time of runStartClrSIS() (ns) */
+static unsigned int sisMade=0;         /* Entries made since then */
+static unsigned int sisTaken=0;        /* Entries read */
+static unsigned int sisChan=0;         /* Next channel of the head entry */
+static unsigned int sisFifo[SIS_FIFO_ENTRIES][SIS_NCHAN];  /* Replayed entries */
+
+/* Replayed entries into the FIFO (called with emuMutex held).  When it
+   is full the new entries are lost. */
+void
+emuSisPush(unsigned int *entry, int nentry)
+{
+  int ie;
+
+  if(!sisRun)
+    return;
+
+  for(ie = 0; ie < nentry; ie++)
+    {
+      if(sisMade - sisTaken >= SIS_FIFO_ENTRIES)
+	break;
+      memcpy(sisFifo[sisMade % SIS_FIFO_ENTRIES], &entry[ie*SIS_NCHAN],
+	     SIS_NCHAN*sizeof(unsigned int));
+      sisMade++;
+    }
+}
+
+/* Entries in the FIFO */
+static unsigned int
+sisPending()
+{
+  unsigned int due;
+
+  if(!sisRun)
+    return 0;
+
+  if(emuReplayOn)
+    {
+      emuBlocksDone();  /* Blocks due, with their entries */
+      return sisMade - sisTaken;
+    }
+
+  if(emuCfg.scalRate <= 0)
+    return 0;
+
+  due = (unsigned int)((emuNow() - sisStart)*1e-9*emuCfg.scalRate);
+  if(due - sisTaken > SIS_FIFO_ENTRIES)  /* Full: the rest are lost */
+    sisTaken = due - SIS_FIFO_ENTRIES;
+  sisMade = due;
+
+  return sisMade - sisTaken;
+}
+
+/* Channel chan of entry number entry */
+static unsigned int
+sisValue(unsigned int entry, int chan)
+{
+  unsigned int seed = entry*31 + chan + emuCfg.seed;
+  unsigned int count, mean;
+
+  if(emuReplayOn)
+    return sisFifo[entry % SIS_FIFO_ENTRIES][chan];
+
+  mean  = (chan + 1)*1000;
+  count = mean + emuRand(&seed) % (mean/10 + 1);
+  if(chan == 0)
+    count |= ((entry & 1) << 30) | ((entry % 4 == 0) << 31) | (0x3f << 24);
+
+  return count;
+}
+
+static int
+sisFill(volatile unsigned int *data, unsigned int addr, int nbytes)
+{
+  int n = 0;
+
+  while((n < nbytes/4) && sisPending())
+    {
+      data[n++] = LSWAP(sisValue(sisTaken, sisChan));
+      if(++sisChan == SIS_NCHAN)
+	{
+	  sisChan = 0;
+	  sisTaken++;
+	}
+    }
+
+  return n ? n*4 : ERROR;
+}
+
+int
+initSIS()
+{
+  emuInit();
+  emuDmaSource(emuCfg.sisAddr + 0x100, 0x100, sisFill);
+  sisRun = 0;
+  return OK;
+}
+
+int
+clrAllCntSIS()
+{
+  sisTaken = sisMade;
+  sisChan = 0;
+  return OK;
+}
+
+int
+runStartClrSIS()
+{
+  sisStart = emuNow();
+  sisMade = sisTaken = sisChan = 0;
+  sisRun = 1;
+  return OK;
+}
+
+/* Non-zero while the FIFO has an entry */
+int
+SISFIFO_Check()
+{
+  emuSct(1);
+  return sisPending() ? 1 : 0;
+}
+
+int
+SISFIFO_Read()
+{
+  return SISFIFO_Check();
+}
+
+int
+SISFIFO_start()
+{
+  return OK;
+}
+
+/* Channel chan of the entry at the head of the FIFO.  Reading the last
+   channel takes the entry from the FIFO. */
+unsigned int
+Read3801(int id, int chan)
+{
+  unsigned int val;
+
+  emuSct(1);
+  if(!sisPending())
+    return 0;
+
+  val = sisValue(sisTaken, chan % SIS_NCHAN);
+  if((chan % SIS_NCHAN) == SIS_NCHAN - 1)
+    {
+      sisTaken++;
+      sisChan = 0;
+    }
+
+  return val;
+}
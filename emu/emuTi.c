@@ -0,0 +1,697 @@
+/*************************************************************************
+ *
+ *  emuTi.c - Emulated TI (trigger interface).
+ *
+ *  Triggers arrive at EMU_TRIGGER_RATE (or the rate of the random
+ *  pulser, tiSetRandomTrigger()) while the trigger source is enabled.
+ *  A trigger is lost while the TI is busy:
+ *     - the buffer level is reached (blocks built and not acknowledged),
+ *     - the holdoff (rule 1) since the last accepted trigger has not passed,
+ *     - the modules are more than EMU_NBLOCK/2 blocks behind.
+ *  Accepted triggers are grouped in blocks of the current block level.
+ *  Every tiSetSyncEventInterval() blocks is a sync event, where a level
+ *  from tiBroadcastNextBlockLevel() takes effect.
+ *
+ *  tiIntEnable() starts a thread that polls tiBReady() and calls the
+ *  routine given to tiIntConnect(), as the TI library does in polling
+ *  mode.
+ *
+ *************************************************************************/
+
+#include <unistd.h>
+#include <sched.h>
+#include "emuLib.h"
+
+unsigned int tiIntCount=0;
+int tiDoAck=0;
+int tiNeedAck=0;
+int tiFiberLatencyOffset=0xbf;
+
+static emuBlock tiBlock[EMU_NBLOCK];
+static unsigned int tiBlocks=0;       /* Blocks built */
+static unsigned int tiBlocksRead=0;   /* Blocks read by tiReadTriggerBlock() */
+static unsigned int tiBlocksAcked=0;  /* Blocks acknowledged */
+static int tiFill=0;                  /* Events in the block being built */
+static unsigned int tiEvents=0;       /* Triggers accepted */
+static unsigned long long tiOffered=0; /* Triggers arrived */
+
+static int tiLevel=1, tiNextLevel=0, tiBufferLevel=1;
+static unsigned int tiBlockLimit=0, tiSyncInterval=0, tiHoldoffNs=0;
+static int tiSyncFlag=0;     /* Sync event flag of the last block read */
+static int tiTrigOn=0;       /* Trigger source enabled */
+static int tiRandomSetting=-1;  /* Random pulser setting, -1 if off */
+static unsigned long long tiNext=0, tiLastAccept=0, tiZero=0;
+static unsigned int tiSeed;
+static unsigned long long tiReplayN=0;      /* Recorded blocks replayed */
+static unsigned long long tiReplayStart=0;  /* Time the replay started */
+
+static void (*tiIntRoutine)(int) = NULL;
+static int tiIntArg=0;
+static pthread_t tiPollPth;
+static volatile int tiPollRun=0;
+
+static double
+tiRate()
+{
+  if(tiRandomSetting >= 0)
+    return 500000./(1 << tiRandomSetting);
+
+  return emuCfg.trigRate;
+}
+
+/* Time to the next trigger (ns) */
+static unsigned long long
+tiInterval()
+{
+  double rate = tiRate();
+
+  if(rate <= 0)
+    return 1000000000ULL;
+
+  if(emuCfg.trigFixed && (tiRandomSetting < 0))
+    return (unsigned long long)(1e9/rate);
+
+  return (unsigned long long)(-log(1. - emuRandom(&tiSeed))*1e9/rate) + 1;
+}
+
+static void
+tiReset()
+{
+  pthread_mutex_lock(&emuMutex);
+  tiBlocks = tiBlocksRead = tiBlocksAcked = 0;
+  tiFill = 0;
+  tiEvents = 0;
+  tiOffered = 0;
+  tiSyncFlag = 0;
+  tiZero = tiLastAccept = emuNow();
+  tiSeed = emuCfg.seed;
+  tiReplayN = 0;
+  pthread_mutex_unlock(&emuMutex);
+}
+
+/* Busy until the readout catches up */
+static int
+tiBusy()
+{
+  return (((tiBufferLevel > 0) && (tiBlocks - tiBlocksAcked >= tiBufferLevel)) ||
+	  (tiBlocks - tiBlocksRead >= EMU_NBLOCK/2));
+}
+
+/* A new block is complete */
+static void
+tiBlockDone(emuBlock *blk)
+{
+  if(tiSyncInterval && ((blk->number % tiSyncInterval) == 0))
+    {
+      blk->sync = 1;
+      if(tiNextLevel)
+	{
+	  tiLevel = tiNextLevel;
+	  tiNextLevel = 0;
+	}
+    }
+  tiFill = 0;
+  tiBlocks++;
+}
+
+/* Replay: take the recorded blocks due by now.  One that comes while
+   busy is lost, but its scaler entries go in the FIFO. */
+static void
+tiReplayUpdate(unsigned long long now)
+{
+  unsigned long long t, *ts;
+  unsigned int *sis;
+  emuBlock *blk;
+  int rec, iev, nsis;
+
+  while(tiTrigOn)
+    {
+      rec = emuReplayBlock(tiReplayN, &t);
+      if(rec < 0)
+	{
+	  tiTrigOn = 0;
+	  break;
+	}
+      if(tiReplayStart + t > now)
+	break;
+
+      if(tiBlockLimit && (tiBlocks >= tiBlockLimit))
+	{
+	  tiTrigOn = 0;
+	  break;
+	}
+
+      tiReplayN++;
+      tiOffered += emuReplayLevel(rec);
+      if((nsis = emuReplayScalers(rec, &sis)) > 0)
+	emuSisPush(sis, nsis);
+
+      if(tiBusy())
+	continue;
+
+      blk = &tiBlock[tiBlocks & (EMU_NBLOCK-1)];
+      blk->number = tiBlocks + 1;
+      blk->level  = emuReplayLevel(rec);
+      blk->event  = tiEvents + 1;
+      blk->sync   = 0;
+      blk->rec    = rec;
+      ts = emuReplayTimes(rec);
+      for(iev = 0; iev < blk->level; iev++)
+	blk->ts[iev] = ts ? ts[iev] : ((tiReplayStart + t - tiZero)/4 + iev) & 0xffffffffffffULL;
+      tiEvents += blk->level;
+      tiBlockDone(blk);
+    }
+}
+
+/* Accept the triggers that arrived up to now.  Call with emuMutex held. */
+static void
+tiUpdate()
+{
+  unsigned long long now = emuNow(), t;
+  emuBlock *blk;
+
+  if(emuReplayOn)
+    {
+      tiReplayUpdate(now);
+      return;
+    }
+
+  while(tiTrigOn && (tiNext <= now))
+    {
+      t = tiNext;
+      tiNext += tiInterval();
+
+      if(tiBlockLimit && (tiBlocks >= tiBlockLimit))
+	{
+	  tiTrigOn = 0;
+	  break;
+	}
+
+      tiOffered++;
+
+      /* Busy until the readout catches up: count the rest as lost */
+      if(tiBusy())
+	{
+	  tiOffered += (unsigned long long)((now - t)*tiRate()/1e9);
+	  tiNext = now + tiInterval();
+	  break;
+	}
+
+      if((tiEvents > 0) && (t - tiLastAccept < tiHoldoffNs))
+	continue;
+
+      blk = &tiBlock[tiBlocks & (EMU_NBLOCK-1)];
+      if(tiFill == 0)
+	{
+	  blk->number = tiBlocks + 1;
+	  blk->level  = tiLevel;
+	  blk->event  = tiEvents + 1;
+	  blk->sync   = 0;
+	  blk->rec    = -1;
+	}
+      blk->ts[tiFill++] = ((t - tiZero)/4) & 0xffffffffffffULL;
+      tiEvents++;
+      tiLastAccept = t;
+
+      if(tiFill == blk->level)
+	tiBlockDone(blk);
+    }
+}
+
+/* Blocks built so far (for the modules) */
+unsigned int
+emuBlocksDone()
+{
+  unsigned int rval;
+
+  pthread_mutex_lock(&emuMutex);
+  tiUpdate();
+  rval = tiBlocks;
+  pthread_mutex_unlock(&emuMutex);
+
+  return rval;
+}
+
+/* Block by number (from 1).  NULL if it is not built or no longer kept. */
+emuBlock *
+emuBlockGet(unsigned int number)
+{
+  emuBlock *blk;
+
+  if((number == 0) || (number > emuBlocksDone()))
+    return NULL;
+
+  blk = &tiBlock[(number - 1) & (EMU_NBLOCK-1)];
+
+  return (blk->number == number) ? blk : NULL;
+}
+
+/*************************************************************************
+ *  Initialization and setup
+ *************************************************************************/
+
+int
+tiSetFiberLatencyOffset_preInit(int flo)
+{
+  tiFiberLatencyOffset = flo;
+  return OK;
+}
+
+int
+tiSetFiberIn_preInit(int port)
+{
+  return OK;
+}
+
+int
+tiInit(unsigned int tAddr, unsigned int mode, int iFlag)
+{
+  emuInit();
+  tiReset();
+  printf("tiInit: Emulated TI in slot 21\n");
+  return OK;
+}
+
+int
+tiSetCrateID(unsigned int crateID)
+{
+  return OK;
+}
+
+int
+tiSetEventFormat(int format)
+{
+  return OK;
+}
+
+int
+tiDisableVXSSignals()
+{
+  return OK;
+}
+
+int
+tiEnableVXSSignals()
+{
+  return OK;
+}
+
+int
+tiClockReset()
+{
+  return OK;
+}
+
+int
+tiTrigLinkReset()
+{
+  return OK;
+}
+
+int
+tiSyncReset(int blflag)
+{
+  tiReset();
+  return OK;
+}
+
+int
+tiSetBusySource(unsigned int sourcemask, int rFlag)
+{
+  return OK;
+}
+
+int
+tiEnableDataReadout()
+{
+  return OK;
+}
+
+int
+tiEnableTSInput(unsigned int inpMask)
+{
+  return OK;
+}
+
+int
+tiFakeTriggerBankOnError(int enable)
+{
+  return OK;
+}
+
+int
+tiLoadTriggerTable(int mode)
+{
+  return OK;
+}
+
+int
+tiRocEnable(int roc)
+{
+  return OK;
+}
+
+int
+tiSetFPInputReadout(int enable)
+{
+  return OK;
+}
+
+int
+tiSetOutputPort(unsigned int set1, unsigned int set2, unsigned int set3,
+		unsigned int set4)
+{
+  return OK;
+}
+
+int
+tiSetSyncDelayWidth(unsigned int delay, unsigned int width, int widthstep)
+{
+  return OK;
+}
+
+int
+tiSetTriggerLatchOnLevel(int enable)
+{
+  return OK;
+}
+
+int
+tiSetTriggerSource(int trig)
+{
+  return OK;
+}
+
+int
+tiUnload(int pflag)
+{
+  return OK;
+}
+
+int
+tiSetBlockLevel(int blockLevel)
+{
+  if((blockLevel < 1) || (blockLevel > EMU_MAX_LEVEL))
+    {
+      printf("%s: ERROR: Invalid block level (%d)\n", __func__, blockLevel);
+      return ERROR;
+    }
+
+  pthread_mutex_lock(&emuMutex);
+  tiLevel = blockLevel;
+  pthread_mutex_unlock(&emuMutex);
+
+  return blockLevel;
+}
+
+int
+tiBroadcastNextBlockLevel(int blockLevel)
+{
+  if((blockLevel < 1) || (blockLevel > EMU_MAX_LEVEL))
+    return ERROR;
+
+  emuSct(1);
+  pthread_mutex_lock(&emuMutex);
+  tiNextLevel = blockLevel;
+  pthread_mutex_unlock(&emuMutex);
+
+  return OK;
+}
+
+int
+tiGetCurrentBlockLevel()
+{
+  emuSct(1);
+  return tiLevel;
+}
+
+int
+tiSetBlockBufferLevel(unsigned int level)
+{
+  tiBufferLevel = level;
+  return OK;
+}
+
+int
+tiSetSyncEventInterval(int blk_interval)
+{
+  tiSyncInterval = blk_interval;
+  return OK;
+}
+
+int
+tiGetSyncEventFlag()
+{
+  emuSct(1);
+  return tiSyncFlag;
+}
+
+int
+tiSetBlockLimit(unsigned int limit)
+{
+  pthread_mutex_lock(&emuMutex);
+  tiBlockLimit = limit;
+  pthread_mutex_unlock(&emuMutex);
+  return OK;
+}
+
+/* Rule 1 only: least time between two triggers */
+int
+tiSetTriggerHoldoff(int rule, unsigned int value, int timestep)
+{
+  if(rule == 1)
+    tiHoldoffNs = value * (timestep ? 480 : 16);
+  return OK;
+}
+
+int
+tiSetRandomTrigger(int trigger, int setting)
+{
+  pthread_mutex_lock(&emuMutex);
+  tiRandomSetting = setting & 0xf;
+  tiTrigOn = 1;
+  tiNext = emuNow() + tiInterval();
+  pthread_mutex_unlock(&emuMutex);
+  return OK;
+}
+
+int
+tiDisableRandomTrigger()
+{
+  tiRandomSetting = -1;
+  return OK;
+}
+
+int
+tiDisableTriggerSource(int fflag)
+{
+  pthread_mutex_lock(&emuMutex);
+  tiUpdate();
+  tiTrigOn = 0;
+  pthread_mutex_unlock(&emuMutex);
+  return OK;
+}
+
+/*************************************************************************
+ *  Readout
+ *************************************************************************/
+
+int
+tiBReady()
+{
+  unsigned int rval;
+
+  emuSct(1);
+  pthread_mutex_lock(&emuMutex);
+  tiUpdate();
+  rval = tiBlocks - tiBlocksRead;
+  pthread_mutex_unlock(&emuMutex);
+
+  return rval;
+}
+
+int
+tiBlockStatus(int nbuf, int pflag)
+{
+  return 0;
+}
+
+/* The next block as a CODA trigger bank (tag 0xFF11, segments):
+     bank length
+     0xFF11 | 0x20 (segments) | block level
+     for each event: segment header (event type 1, uint32, 3 words),
+                     event number, trigger time bits 31-0, bits 47-32 */
+int
+tiReadTriggerBlock(volatile unsigned int *data)
+{
+  emuBlock *blk;
+  int iev, nwords;
+
+  pthread_mutex_lock(&emuMutex);
+  tiUpdate();
+  if(tiBlocksRead == tiBlocks)
+    {
+      pthread_mutex_unlock(&emuMutex);
+      printf("%s: ERROR: No data\n", __func__);
+      return ERROR;
+    }
+  blk = &tiBlock[tiBlocksRead & (EMU_NBLOCK-1)];
+  tiBlocksRead++;
+  tiSyncFlag = blk->sync;
+  pthread_mutex_unlock(&emuMutex);
+
+  nwords = 2 + 4*blk->level;
+  *data++ = LSWAP(nwords - 1);
+  *data++ = LSWAP(0xFF112000 | blk->level);
+  for(iev = 0; iev < blk->level; iev++)
+    {
+      *data++ = LSWAP((1<<24) | (0x01<<16) | 3);
+      *data++ = LSWAP(blk->event + iev);
+      *data++ = LSWAP(blk->ts[iev] & 0xffffffff);
+      *data++ = LSWAP((blk->ts[iev] >> 32) & 0xffff);
+    }
+
+  emuDma(nwords);
+
+  return nwords;
+}
+
+unsigned int
+tiGetIntCount()
+{
+  return tiIntCount;
+}
+
+/* Live time, per mille (triggers accepted / arrived) */
+int
+tiLive(int sflag)
+{
+  int rval;
+
+  emuSct(2);
+  pthread_mutex_lock(&emuMutex);
+  rval = tiOffered ? (int)((1000ULL*tiEvents)/tiOffered) : 1000;
+  pthread_mutex_unlock(&emuMutex);
+
+  return rval;
+}
+
+int
+tiStatus(int pflag)
+{
+  pthread_mutex_lock(&emuMutex);
+  tiUpdate();
+  if(emuReplayOn)
+    printf("Emulated TI: replay of %s, %llu recorded blocks so far, %s\n",
+	   emuCfg.replayFile, tiReplayN, tiTrigOn ? "enabled" : "disabled");
+  else
+    printf("Emulated TI: %.0f Hz %s triggers, %s\n", tiRate(),
+	   (emuCfg.trigFixed && (tiRandomSetting < 0)) ? "fixed" : "random",
+	   tiTrigOn ? "enabled" : "disabled");
+  printf("  Block level %d (next %d), buffer level %d, holdoff %u ns, block limit %u\n",
+	 tiLevel, tiNextLevel, tiBufferLevel, tiHoldoffNs, tiBlockLimit);
+  printf("  %u blocks built, %u read, %u acknowledged\n",
+	 tiBlocks, tiBlocksRead, tiBlocksAcked);
+  printf("  %u triggers accepted of %llu (live %.1f%%)\n", tiEvents, tiOffered,
+	 tiOffered ? 100.*tiEvents/tiOffered : 100.);
+  pthread_mutex_unlock(&emuMutex);
+
+  return OK;
+}
+
+/*************************************************************************
+ *  Polling thread
+ *************************************************************************/
+
+int
+tiIntAck()
+{
+  emuSct(1);
+  pthread_mutex_lock(&emuMutex);
+  if(tiBlocksAcked < tiBlocks)
+    tiBlocksAcked++;
+  pthread_mutex_unlock(&emuMutex);
+
+  return OK;
+}
+
+static void *
+tiPoll(void *arg)
+{
+  while(tiPollRun)
+    {
+      /* Do not look for blocks until the last one is acknowledged */
+      if(tiNeedAck > 0)
+	{
+	  sched_yield();
+	  continue;
+	}
+
+      if(tiBReady() > 0)
+	{
+	  tiIntCount++;
+	  if(tiIntRoutine)
+	    (*tiIntRoutine)(tiIntArg);
+	  if(tiDoAck == 1)
+	    tiIntAck();
+	}
+      else
+	sched_yield();  /* Leave the CPU to the output thread on a small host */
+    }
+
+  return NULL;
+}
+
+int
+tiIntConnect(unsigned int vector, void (*routine)(), unsigned int arg)
+{
+  tiIntRoutine = (void (*)(int))routine;
+  tiIntArg = arg;
+  tiIntCount = 0;
+  tiDoAck = 1;
+  tiNeedAck = 0;
+  tiReset();
+
+  return OK;
+}
+
+int
+tiIntDisconnect()
+{
+  tiIntRoutine = NULL;
+  return OK;
+}
+
+int
+tiIntEnable(int iflag)
+{
+  pthread_mutex_lock(&emuMutex);
+  tiTrigOn = 1;
+  tiReplayStart = emuNow();
+  tiNext = tiReplayStart + tiInterval();
+  pthread_mutex_unlock(&emuMutex);
+
+  tiPollRun = 1;
+  if(pthread_create(&tiPollPth, NULL, tiPoll, NULL) != 0)
+    {
+      perror("tiIntEnable: pthread_create");
+      tiPollRun = 0;
+      return ERROR;
+    }
+
+  return OK;
+}
+
+int
+tiIntDisable()
+{
+  tiDisableTriggerSource(0);
+
+  if(tiPollRun)
+    {
+      tiPollRun = 0;
+      pthread_join(tiPollPth, NULL);
+    }
+
+  return OK;
+}
@@ -0,0 +1,312 @@
+/*************************************************************************
+ *
+ *  emuVetroc.c - Emulated VETROCs.
+ *
+ *  Each module makes its block from the event numbers and trigger
+ *  times of the next TI block when it is read:
+ *
+ *    block header   0x80000000 | slot<<22 | block number<<8 | level
+ *    event header   0x90000000 | slot<<22 | event number
+ *    trigger time   0x98000000 | time bits 23-0,  then  time bits 47-24
+ *    TDC hit        0xC0000000 | edge<<26 | channel<<16 | time
+ *    block trailer  0x88000000 | slot<<22 | words in the block
+ *    filler         0xF8000000 | slot<<22, to an even number of words
+ *
+ *  Hits come at EMU_VETROC_HITS per module and event, each a leading
+ *  edge and a trailing edge 20-50 ns later.
+ *
+ *  nvetroc is left to the readout list, which defines it.
+ *
+ *************************************************************************/
+
+#include "emuLib.h"
+
+#define VT_NCH      192  /* TDC channels */
+#define VT_MAX_HITS 128  /* Hits per module and event */
+
+typedef struct
+{
+  int           slot;
+  unsigned int  nread;  /* Blocks read */
+} emuVetroc;
+
+int vetrocA32Base=0x09000000;
+
+static emuVetroc vtMod[EMU_MAX_BOARD];
+static int vtCount=0;
+static int vtMultiBlock=0;
+static int vtWindow=2000;  /* Window width (ns) */
+
+static emuVetroc *
+vtFind(int id)
+{
+  int ivt;
+
+  for(ivt = 0; ivt < vtCount; ivt++)
+    if(vtMod[ivt].slot == id)
+      return &vtMod[ivt];
+
+  printf("vetrocLib: ERROR: No VETROC in slot %d\n", id);
+  return NULL;
+}
+
+int
+vetrocInit(unsigned int addr, unsigned int addr_inc, int nvt, int iFlag)
+{
+  int ivt, slot;
+
+  emuInit();
+
+  vtCount = 0;
+  if(nvt > EMU_MAX_BOARD)
+    nvt = EMU_MAX_BOARD;
+
+  for(ivt = 0; ivt < nvt; ivt++)
+    {
+      slot = (addr + ivt*addr_inc) >> 19;
+      if((slot < 2) || (slot > 21))
+	break;
+
+      vtMod[vtCount].slot  = slot;
+      vtMod[vtCount].nread = 0;
+      vtCount++;
+    }
+
+  printf("vetrocInit: %d emulated VETROCs, first in slot %d\n", vtCount,
+	 vtCount ? vtMod[0].slot : 0);
+
+  return vtCount;
+}
+
+int
+vetrocSlot(unsigned int i)
+{
+  if(i >= vtCount)
+    return ERROR;
+
+  return vtMod[i].slot;
+}
+
+unsigned int
+vetrocScanMask()
+{
+  unsigned int mask = 0;
+  int ivt;
+
+  for(ivt = 0; ivt < vtCount; ivt++)
+    mask |= (1 << vtMod[ivt].slot);
+
+  return mask;
+}
+
+int
+vetrocConfig(char *fname)
+{
+  return 0;
+}
+
+int
+vetrocGSetProcMode(int lookBack, int windowWidth)
+{
+  vtWindow = windowWidth;
+  return OK;
+}
+
+int
+vetrocGSetBlockLevel(int level)
+{
+  return OK;
+}
+
+int
+vetrocEnableMultiBlock()
+{
+  vtMultiBlock = (vtCount > 1);
+  return OK;
+}
+
+int
+vetrocDisableMultiBlock()
+{
+  vtMultiBlock = 0;
+  return OK;
+}
+
+/* Start from the first block of the next run */
+int
+vetrocClear(int id)
+{
+  emuVetroc *vt = vtFind(id);
+
+  if(vt)
+    vt->nread = 0;
+  return OK;
+}
+
+int
+vetrocLinkReset(int id)
+{
+  return OK;
+}
+
+/*************************************************************************
+ *  Readout
+ *************************************************************************/
+
+unsigned int
+vetrocGBready()
+{
+  unsigned int done, mask = 0;
+  int ivt;
+
+  emuSct(vtCount);
+  done = emuBlocksDone();
+  for(ivt = 0; ivt < vtCount; ivt++)
+    if(vtMod[ivt].nread < done)
+      mask |= (1 << vtMod[ivt].slot);
+
+  return mask;
+}
+
+#define PUT(__w) { if(n < max) data[n] = LSWAP(__w); n++; }
+
+/* Block of vt for the TI block blk into data (at most max words).
+   Returns the words in the block, which may be more than max. */
+static int
+vtBlockData(emuVetroc *vt, emuBlock *blk, volatile unsigned int *data, int max)
+{
+  int n = 0, iev, ihit, nhit, ch, t, window;
+  unsigned int seed, slot = vt->slot << 22, evnum;
+  unsigned long long ts;
+
+  if((blk->rec >= 0) &&
+     ((n = emuReplayRead(blk->rec, EMU_REPLAY_VETROC, vt - vtMod, data, max)) > 0))
+    return n;
+
+  window = vtWindow > 60 ? vtWindow - 50 : 10;
+
+  PUT(0x80000000 | slot | ((blk->number & 0x3ff)<<8) | (blk->level & 0xff));
+
+  for(iev = 0; iev < blk->level; iev++)
+    {
+      evnum = blk->event + iev;
+      ts = blk->ts[iev];
+      seed = evnum*104729 + vt->slot + emuCfg.seed;
+
+      PUT(0x90000000 | slot | (evnum & 0x3fffff));
+      PUT(0x98000000 | (ts & 0xffffff));
+      PUT((ts >> 24) & 0xffffff);
+
+      nhit = emuPoisson(&seed, emuCfg.vtHits);
+      if(nhit > VT_MAX_HITS)
+	nhit = VT_MAX_HITS;
+      for(ihit = 0; ihit < nhit; ihit++)
+	{
+	  ch = emuRand(&seed) % VT_NCH;
+	  t  = emuRand(&seed) % window;
+	  PUT(0xC0000000 | (ch<<16) | (t & 0xffff));
+	  PUT(0xC0000000 | (1<<26) | (ch<<16) | ((t + 20 + emuRand(&seed) % 30) & 0xffff));
+	}
+    }
+
+  PUT(0x88000000 | slot | ((n + 1) & 0x3fffff));
+  if(n & 1)
+    PUT(0xF8000000 | slot);
+
+  return n;
+}
+
+/* rflag: 0 single cycles, 1 DMA, 2 multiblock DMA (from the first module) */
+int
+vetrocReadBlock(int id, volatile unsigned int *data, int nwrds, int rflag)
+{
+  emuVetroc *vt = vtFind(id);
+  emuBlock *blk;
+  int ivt, first, last, n, nblk, dummy = 0;
+
+  if((vt == NULL) || (data == NULL) || (nwrds <= 0))
+    return ERROR;
+
+  first = vt - vtMod;
+  last  = first;
+  if(rflag == 2)
+    {
+      if(!vtMultiBlock || (first != 0))
+	{
+	  printf("%s: ERROR: Multiblock readout is not enabled for slot %d\n",
+		 __func__, id);
+	  return ERROR;
+	}
+      last = vtCount - 1;
+    }
+
+  /* The library reads one dummy word first if the destination is not
+     8-byte aligned for the DMA */
+  if((rflag > 0) && emuDmaMode64() && (((unsigned long)data) & 0x7))
+    {
+      *data++ = LSWAP(0xF800FAFA);
+      nwrds--;
+      dummy = 1;
+    }
+
+  n = 0;
+  for(ivt = first; ivt <= last; ivt++)
+    {
+      blk = emuBlockGet(vtMod[ivt].nread + 1);
+      if(blk == NULL)
+	{
+	  printf("%s: ERROR: Slot %d has no block ready\n", __func__, vtMod[ivt].slot);
+	  break;
+	}
+      vtMod[ivt].nread++;
+
+      nblk = vtBlockData(&vtMod[ivt], blk, data + n, nwrds - n);
+      if(n + nblk > nwrds)
+	{
+	  printf("%s: ERROR: Block of slot %d (%d words) ends past the limit (%d)\n",
+		 __func__, vtMod[ivt].slot, nblk, nwrds - n);
+	  n = nwrds;
+	  break;
+	}
+      n += nblk;
+    }
+
+  if(rflag == 0)
+    emuSct(n);
+  else
+    emuDma(n);
+
+  return n + dummy;
+}
+
+int
+vetrocReadFIFO(int id, volatile unsigned int *data, int nwrds, int rflag)
+{
+  return vetrocReadBlock(id, data, nwrds, rflag);
+}
+
+int
+vetrocStatus(int id, int sflag)
+{
+  emuVetroc *vt = vtFind(id);
+
+  if(vt == NULL)
+    return ERROR;
+
+  printf("Emulated VETROC in slot %2d: window %d ns, %u blocks read\n",
+	 vt->slot, vtWindow, vt->nread);
+
+  return OK;
+}
+
+int
+vetrocGStatus(int sflag)
+{
+  int ivt;
+
+  printf("Emulated VETROCs (%s):\n", vtMultiBlock ? "multiblock" : "single board");
+  for(ivt = 0; ivt < vtCount; ivt++)
+    vetrocStatus(vtMod[ivt].slot, sflag);
+
+  return OK;
+}
@@ -0,0 +1,524 @@
+/*************************************************************************
+ *
+ *  emuVme.c - Emulated jvme: DMA buffer partitions, VME DMA engine,
+ *             bus lock, and the timing model used by the other modules.
+ *
+ *************************************************************************/
+
+#include <time.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include "emuLib.h"
+
+emuConfig emuCfg;
+pthread_mutex_t emuMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t emuOnce = PTHREAD_ONCE_INIT;
+
+/*! Buffer node pointer */
+DMANODE *the_event;
+/*! Data pointer */
+unsigned int *dma_dabufp;
+
+static double
+emuEnv(const char *name, double def)
+{
+  char *val = getenv(name);
+
+  return (val != NULL) ? strtod(val, NULL) : def;
+}
+
+static void
+emuConfigRead()
+{
+  char *val;
+
+  emuCfg.trigRate   = emuEnv("EMU_TRIGGER_RATE", 10000);
+  emuCfg.trigFixed  = (int)emuEnv("EMU_TRIGGER_FIXED", 0);
+  emuCfg.sctNs      = (unsigned int)emuEnv("EMU_SCT_NS", 1000);
+  emuCfg.dmaSetupNs = (unsigned int)emuEnv("EMU_DMA_SETUP_NS", 8000);
+  emuCfg.dmaMBps    = emuEnv("EMU_DMA_MBPS", 0);
+  emuCfg.faPulses   = emuEnv("EMU_FADC_PULSES", 0.2);
+  emuCfg.vtHits     = emuEnv("EMU_VETROC_HITS", 8);
+  emuCfg.scalRate   = emuEnv("EMU_SCALER_RATE", 120);
+  emuCfg.seed       = (unsigned int)emuEnv("EMU_SEED", 1);
+
+  val = getenv("EMU_SIS3801_ADDR");
+  emuCfg.sisAddr = (val != NULL) ? strtoul(val, NULL, 0) : 0xa10000;
+
+  emuCfg.replayFile  = getenv("EMU_REPLAY");
+  emuCfg.replaySpeed = emuEnv("EMU_REPLAY_SPEED", 1);
+  emuCfg.replayLoop  = (int)emuEnv("EMU_REPLAY_LOOP", 1);
+  emuCfg.replayMax   = (unsigned int)emuEnv("EMU_REPLAY_MAX", 20000);
+  emuCfg.replayRoc   = (int)emuEnv("EMU_REPLAY_ROC", 0);
+
+  printf("emuLib: Emulated VME crate: %.0f Hz triggers (%s), %u ns single cycle, %u ns DMA setup\n",
+	 emuCfg.trigRate, emuCfg.trigFixed ? "fixed" : "random",
+	 emuCfg.sctNs, emuCfg.dmaSetupNs);
+
+  if(emuCfg.replayFile && emuCfg.replayFile[0] && (emuCfg.replayMax > 0))
+    emuReplayInit();
+}
+
+void
+emuInit()
+{
+  pthread_once(&emuOnce, emuConfigRead);
+}
+
+unsigned long long
+emuNow()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/* Busy wait, as the CPU does during a VME cycle */
+void
+emuDelay(unsigned long long ns)
+{
+  unsigned long long end = emuNow() + ns;
+
+  while(emuNow() < end)
+    ;
+}
+
+void
+emuSct(int ncycle)
+{
+  if(ncycle > 0)
+    emuDelay((unsigned long long)ncycle*emuCfg.sctNs);
+}
+
+/*************************************************************************
+ *  VME DMA engine
+ *************************************************************************/
+
+static unsigned int dmaAddrType=2, dmaDataType=5, dmaSstMode=1;
+static double dmaRate=200.;  /* MB/s of the current mode */
+static int dmaBytes=0;       /* Bytes of the last vmeDmaSend() */
+
+#define EMU_NSOURCE 8
+static struct
+{
+  unsigned int addr, size;
+  int (*fill)(volatile unsigned int *data, unsigned int addr, int nbytes);
+} dmaSource[EMU_NSOURCE];
+static int dmaNsource=0;
+
+/* Time of one block transfer of nwords */
+void
+emuDma(int nwords)
+{
+  if(nwords <= 0)
+    return;
+
+  if(dmaDataType < 2)  /* D16/D32: single cycles */
+    {
+      emuSct(dmaDataType ? nwords : 2*nwords);
+      return;
+    }
+
+  emuDelay(emuCfg.dmaSetupNs + (unsigned long long)(nwords*4*1000./dmaRate));
+}
+
+/* The DMA mode moves 64-bit words, and needs an 8-byte aligned destination */
+int
+emuDmaMode64()
+{
+  return (dmaDataType >= 3);
+}
+
+/* A module whose data is read by vmeDmaSend() from [addr, addr+size) */
+void
+emuDmaSource(unsigned int addr, unsigned int size,
+	     int (*fill)(volatile unsigned int *data, unsigned int addr, int nbytes))
+{
+  if(dmaNsource >= EMU_NSOURCE)
+    return;
+
+  dmaSource[dmaNsource].addr = addr;
+  dmaSource[dmaNsource].size = size;
+  dmaSource[dmaNsource].fill = fill;
+  dmaNsource++;
+}
+
+int
+vmeDmaConfig(unsigned int addrType, unsigned int dataType, unsigned int sstMode)
+{
+  /* Sustained rates of a VXS crate, MB/s */
+  static const double rate[6] = { 2., 4., 25., 50., 80., 160. };
+  static const double sstRate[3] = { 160., 200., 240. };
+
+  emuInit();
+
+  if(dataType > 5)
+    {
+      printf("%s: ERROR: Invalid dataType (%d)\n", __func__, dataType);
+      return ERROR;
+    }
+
+  dmaAddrType = addrType;
+  dmaDataType = dataType;
+  dmaSstMode  = sstMode;
+
+  dmaRate = rate[dataType];
+  if((dataType == 5) && (sstMode < 3))
+    dmaRate = sstRate[sstMode];
+  if(emuCfg.dmaMBps > 0)
+    dmaRate = emuCfg.dmaMBps;
+
+  return OK;
+}
+
+int
+vmeDmaSend(unsigned long locAdrs, unsigned int vmeAdrs, int size)
+{
+  int isrc;
+
+  dmaBytes = ERROR;
+  for(isrc = 0; isrc < dmaNsource; isrc++)
+    {
+      if((vmeAdrs >= dmaSource[isrc].addr) &&
+	 (vmeAdrs < dmaSource[isrc].addr + dmaSource[isrc].size))
+	{
+	  dmaBytes = (*dmaSource[isrc].fill)((volatile unsigned int *)locAdrs,
+					     vmeAdrs, size);
+	  break;
+	}
+    }
+
+  if(dmaBytes > 0)
+    emuDma(dmaBytes >> 2);
+  else
+    emuDelay(emuCfg.dmaSetupNs);  /* Bus error on the first cycle */
+
+  return OK;
+}
+
+int
+vmeDmaDone()
+{
+  return dmaBytes;
+}
+
+/*************************************************************************
+ *  VME bus and windows
+ *************************************************************************/
+
+static pthread_mutex_t vmeMutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int vmeQuiet=0;
+
+int
+vmeOpenDefaultWindows()
+{
+  emuInit();
+  return OK;
+}
+
+int
+vmeCloseDefaultWindows()
+{
+  return OK;
+}
+
+int
+vmeBusLock()
+{
+  return pthread_mutex_lock(&vmeMutex) ? ERROR : OK;
+}
+
+int
+vmeBusUnlock()
+{
+  return pthread_mutex_unlock(&vmeMutex) ? ERROR : OK;
+}
+
+int
+vmeCheckMutexHealth(int time_seconds)
+{
+  return OK;
+}
+
+void
+vmeSetQuietFlag(unsigned int pflag)
+{
+  vmeQuiet = pflag;
+}
+
+int
+taskDelay(int ticks)
+{
+  usleep(ticks*16667);  /* 60 Hz ticks */
+  return OK;
+}
+
+void
+logMsg(char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+}
+
+/*************************************************************************
+ *  DMA buffer partitions
+ *  Each node is malloc'd, with its DMANODE header in front of the data.
+ *  Free nodes are kept in the partition list, first in first out.
+ *************************************************************************/
+
+#define EMU_MAX_PART 20
+static struct
+{
+  DMA_MEM_ID  id;
+  DMANODE   **node;  /* All nodes of the partition */
+} dmaPart[EMU_MAX_PART];
+static pthread_mutex_t dmaMutex = PTHREAD_MUTEX_INITIALIZER;
+
+int
+dmaPartInit()
+{
+  emuInit();
+  return OK;
+}
+
+DMA_MEM_ID
+dmaPCreate(char *name, int size, int c, int incr)
+{
+  DMA_MEM_ID pPart;
+  DMANODE *node, **nodes;
+  int ipart, inode;
+
+  emuInit();
+
+  if(c <= 0)
+    {
+      printf("%s: ERROR: Unable to create partition %s\n", __func__, name);
+      return 0;
+    }
+
+  /* Build the partition first, then find and claim a free slot for it
+     under one hold of dmaMutex */
+  pPart = calloc(1, sizeof(*pPart));
+  nodes = calloc(c, sizeof(DMANODE *));
+  if((pPart == NULL) || (nodes == NULL))
+    {
+      free(pPart);
+      free(nodes);
+      return 0;
+    }
+
+  strncpy(pPart->name, name, sizeof(pPart->name) - 1);
+  pPart->size  = size + sizeof(DMANODE);
+  pPart->incr  = incr;
+  pPart->total = c;
+
+  for(inode = 0; inode < c; inode++)
+    {
+      node = calloc(1, pPart->size);
+      if(node == NULL)
+	{
+	  printf("%s: ERROR: Out of memory for partition %s\n", __func__, name);
+	  pPart->total = inode;
+	  break;
+	}
+      node->part = pPart;
+      nodes[inode] = node;
+    }
+
+  pthread_mutex_lock(&dmaMutex);
+  for(ipart = 0; ipart < EMU_MAX_PART; ipart++)
+    if(dmaPart[ipart].id == NULL)
+      break;
+  if(ipart < EMU_MAX_PART)
+    {
+      dmaPart[ipart].id   = pPart;
+      dmaPart[ipart].node = nodes;
+    }
+  pthread_mutex_unlock(&dmaMutex);
+
+  if(ipart == EMU_MAX_PART)
+    {
+      printf("%s: ERROR: Unable to create partition %s\n", __func__, name);
+      for(inode = 0; inode < pPart->total; inode++)
+	free(nodes[inode]);
+      free(nodes);
+      free(pPart);
+      return 0;
+    }
+
+  dmaPReInit(pPart);
+
+  return pPart;
+}
+
+static int
+dmaPIndex(DMA_MEM_ID pPart)
+{
+  int ipart;
+
+  for(ipart = 0; ipart < EMU_MAX_PART; ipart++)
+    if((pPart != NULL) && (dmaPart[ipart].id == pPart))
+      return ipart;
+
+  return ERROR;
+}
+
+/* Put every node of the partition back in its list */
+int
+dmaPReInit(DMA_MEM_ID pPart)
+{
+  int ipart, inode;
+  DMANODE *node;
+
+  pthread_mutex_lock(&dmaMutex);
+  if((ipart = dmaPIndex(pPart)) == ERROR)
+    {
+      pthread_mutex_unlock(&dmaMutex);
+      return ERROR;
+    }
+
+  pPart->list.f = pPart->list.l = NULL;
+  pPart->list.c = 0;
+  for(inode = 0; inode < pPart->total; inode++)
+    {
+      node = dmaPart[ipart].node[inode];
+      node->n = NULL;
+      node->p = pPart->list.l;
+      if(pPart->list.l)
+	pPart->list.l->n = node;
+      else
+	pPart->list.f = node;
+      pPart->list.l = node;
+      pPart->list.c++;
+    }
+  pthread_mutex_unlock(&dmaMutex);
+
+  return OK;
+}
+
+int
+dmaPReInitAll()
+{
+  int ipart;
+
+  for(ipart = 0; ipart < EMU_MAX_PART; ipart++)
+    if(dmaPart[ipart].id)
+      dmaPReInit(dmaPart[ipart].id);
+
+  return OK;
+}
+
+int
+dmaPFree(DMA_MEM_ID pPart)
+{
+  int ipart, inode;
+
+  pthread_mutex_lock(&dmaMutex);
+  if((ipart = dmaPIndex(pPart)) == ERROR)
+    {
+      pthread_mutex_unlock(&dmaMutex);
+      return ERROR;
+    }
+
+  for(inode = 0; inode < pPart->total; inode++)
+    free(dmaPart[ipart].node[inode]);
+  free(dmaPart[ipart].node);
+  dmaPart[ipart].node = NULL;
+  dmaPart[ipart].id = NULL;
+  pthread_mutex_unlock(&dmaMutex);
+
+  free(pPart);
+
+  return OK;
+}
+
+int
+dmaPFreeAll()
+{
+  int ipart;
+
+  for(ipart = 0; ipart < EMU_MAX_PART; ipart++)
+    if(dmaPart[ipart].id)
+      dmaPFree(dmaPart[ipart].id);
+
+  return OK;
+}
+
+DMANODE *
+dmaPGetItem(DMA_MEM_ID pPart)
+{
+  DMANODE *node;
+
+  pthread_mutex_lock(&dmaMutex);
+  node = pPart->list.f;
+  if(node)
+    {
+      pPart->list.f = node->n;
+      if(pPart->list.f)
+	pPart->list.f->p = NULL;
+      else
+	pPart->list.l = NULL;
+      pPart->list.c--;
+      node->n = node->p = NULL;
+    }
+  pthread_mutex_unlock(&dmaMutex);
+
+  return node;
+}
+
+/* Return a node to the partition it came from */
+void
+dmaPFreeItem(DMANODE *node)
+{
+  DMA_MEM_ID pPart;
+
+  if(node == NULL)
+    return;
+
+  pPart = node->part;
+  node->length = 0;  /* As jvme does: a buffer is handed out empty */
+
+  pthread_mutex_lock(&dmaMutex);
+  node->n = NULL;
+  node->p = pPart->list.l;
+  if(pPart->list.l)
+    pPart->list.l->n = node;
+  else
+    pPart->list.f = node;
+  pPart->list.l = node;
+  pPart->list.c++;
+  pthread_mutex_unlock(&dmaMutex);
+}
+
+int
+dmaPEmpty(DMA_MEM_ID pPart)
+{
+  return (pPart->list.c == 0);
+}
+
+int
+dmaPNodeCount(DMA_MEM_ID pPart)
+{
+  return pPart->list.c;
+}
+
+void
+dmaPStatsAll()
+{
+  int ipart;
+  DMA_MEM_ID pPart;
+
+  printf("Emulated DMA partitions:\n");
+  printf("  %-20s %10s %6s %6s\n", "name", "size", "total", "free");
+  for(ipart = 0; ipart < EMU_MAX_PART; ipart++)
+    {
+      if((pPart = dmaPart[ipart].id) == NULL)
+	continue;
+      printf("  %-20s %10d %6d %6d\n", pPart->name, pPart->size,
+	     pPart->total, pPart->list.c);
+    }
+}
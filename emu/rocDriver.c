@@ -0,0 +1,521 @@
+/*************************************************************************
+ *
+ *  rocDriver.c - Run a readout list outside of a CODA ROC.
+ *
+ *  Usage:
+ *
+ *    rocDriver [options] vtpCompton_list.so
+ *
+ *      -n triggers   End the run after this many triggers      (10000)
+ *      -t seconds    End the run after this long, 0: no limit      (0)
+ *      -r rate       Trigger rate (Hz), sets EMU_TRIGGER_RATE
+ *      -c file       usrConfig file (ROC_... settings)
+ *      -o file       Write the events to an EVIO file
+ *      -b bytes      Output buffer for one event, at least   (8388608)
+ *      -l lib.so     Load this library first, for the list  (lib/libemu.so)
+ *      -d us         Hold the output thread this long per event    (0)
+ *
+ *  The list is loaded with dlopen() and stepped through the transitions
+ *  the way the ROC does it: rol->daproc set, then <list>__init() called,
+ *  for Init, Download, Prestart and Go.  From Go to the end of End an
+ *  output thread calls <list>__poll() with rol->dabufp at the start of
+ *  its buffer, and takes the event the list wrote there, if any.  The
+ *  run is ended from the main thread while the output thread still
+ *  polls, so the End drain of the list sees its events taken.
+ *
+ *  The program supplies the few symbols a list takes from the ROC
+ *  (daLogMsg, bigendian_out, tsLiveCalc, tsLiveFunc, poolEmpty).  The
+ *  VME libraries are whichever the list was linked with: the real ones
+ *  on a crate, or those of libemu.so (see emuLib.h) on any Linux host.
+ *  A list linked with --as-needed may not name all of them (undefined
+ *  symbol: fadcA32Base, ...), so the library given with -l, or else
+ *  lib/libemu.so next to rocDriver if it is there, is loaded first with
+ *  RTLD_GLOBAL to supply them.
+ *
+ *  The output buffer is made large enough for the event buffers of a
+ *  list built on tiprimary_list.c (rocEventLength, after Prestart).  An
+ *  event larger than the buffer stops the program.
+ *
+ *  At the end it prints the time of each transition, and the events/s,
+ *  triggers/s and MB/s of the output from Go to End, and the time spent
+ *  in <list>__poll() for each event taken (the copy to the output
+ *  buffer).  Triggers are
+ *  counted from the event count in the ROC bank header of each event.
+ *  For a list built on tiprimary_list.c it also prints the free event
+ *  buffers (getInQueueCount()) and queued events (getOutQueueCount())
+ *  seen as each event is taken, and the errCount (no free buffer for a
+ *  block) and emptyCount (last buffer taken) of the run.  With a
+ *  replayed data file (EMU_REPLAY) these show the buffering under the
+ *  recorded load.  With EMU_REPLAY_LOOP=0 the triggers stop at the end
+ *  of the file, so end such a run with -t.
+ *
+ *  The event numbers in the TI trigger bank of each event are checked
+ *  to follow on from those of the event before.  A gap, an event lost
+ *  between the TI and the output, is counted and makes the exit status
+ *  2.  With -d the output thread is slower than the readout, so the
+ *  list's event buffers and output ring fill and it has to hold the
+ *  triggers off.  make -C emu stress runs a list built with an output
+ *  ring smaller than its event pool this way.
+ *
+ *  The EVIO file is EVIO version 4, big endian, one event per block.
+ *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <rol.h>
+#include "jvme.h"
+
+#define DRV_TRIGGERS  10000
+#define DRV_BUFSIZE   (8*1024*1024)
+#define DRV_DRAIN     1000        /* Empty polls after End before stopping */
+
+#define EVIO_MAGIC    0xc0da0100
+#define EVIO_VERSION  4
+#define EVIO_LAST     (1<<9)      /* Last block of the file */
+
+/* From the ROC */
+int bigendian_out=0;
+int tsLiveCalc=0;
+FUNCPTR tsLiveFunc=NULL;
+int poolEmpty=0;
+
+void
+daLogMsg(char *severity, char *fmt, ...)
+{
+  va_list args;
+
+  printf("%-5s: ", severity);
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+  printf("\n");
+}
+
+typedef void (*rolEntry)();
+
+static rolParam drvRol;
+static rolEntry drvInit=NULL, drvPoll=NULL;
+static int drvNevents=0, drvAsyncRoc=0;
+
+static unsigned int *drvBuf=NULL;
+static int drvBufWords=DRV_BUFSIZE/4;
+static FILE *drvOut=NULL;
+
+static volatile int drvStop=0, drvInterrupt=0;
+static pthread_t drvPth;
+
+/* Output counts, written by the output thread */
+static volatile unsigned long long drvEvents=0, drvTriggers=0, drvWords=0;
+static unsigned long long drvPolls=0, drvEmpty=0, drvPollNs=0;
+static unsigned long long drvMissed=0, drvGaps=0;
+static unsigned int drvNextEvent=0;
+static int drvDelayUs=0;
+
+/* Event buffers of the list, if it has them */
+typedef int (*rolCount)();
+static rolCount drvInCount=NULL, drvOutCount=NULL;
+static int *drvErrCount=NULL, *drvEmptyCount=NULL;
+static int drvInMin=-1, drvOutMax=0;
+static unsigned long long drvInSum=0, drvOutSum=0;
+
+static unsigned long long
+drvTimeNs()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned int
+drvSwap(unsigned int w)
+{
+  return __builtin_bswap32(w);
+}
+
+/* The ROC bank header (tag | type | number of events) is in host order
+   if it has a bank data type (0x0e or 0x10) in bits 8-13 */
+static inline int
+drvHostHeader(unsigned int header)
+{
+  return (((header >> 8) & 0x3f) == 0x10) || (((header >> 8) & 0x3f) == 0x0e);
+}
+
+/* Big endian words to the EVIO file */
+static void
+evioWrite(unsigned int *data, int nwords, int swap)
+{
+  int iw;
+  unsigned int w;
+
+  for(iw = 0; iw < nwords; iw++)
+    {
+      w = swap ? drvSwap(data[iw]) : data[iw];
+      fwrite(&w, 4, 1, drvOut);
+    }
+}
+
+static void
+evioBlock(unsigned int *event, int nwords, int last)
+{
+  static unsigned int number=1;
+  unsigned int head[8];
+
+  head[0] = 8 + nwords;
+  head[1] = number++;
+  head[2] = 8;
+  head[3] = nwords ? 1 : 0;
+  head[4] = 0;
+  head[5] = EVIO_VERSION | (last ? EVIO_LAST : 0);
+  head[6] = 0;
+  head[7] = EVIO_MAGIC;
+  evioWrite(head, 8, 1);
+
+  if(nwords == 0)
+    return;
+
+  /* The list writes the bank data big endian (bigendian_out = 1) but
+     the ROC bank header may be in host order */
+  if(bigendian_out)
+    {
+      evioWrite(event, 2, drvHostHeader(event[1]));
+      evioWrite(event + 2, nwords - 2, 0);
+    }
+  else
+    evioWrite(event, nwords, 1);
+}
+
+/* Check that the first event number in the TI trigger bank (tag 0xFFxx,
+   the first bank in the ROC bank) follows the last event of the event
+   before.  Events without one, and user events (event type 0x80 and
+   up in the first segment, e.g. scaler events), are skipped. */
+static void
+drvSequence(unsigned int *event, int nwords)
+{
+  unsigned int header, segment, number, level;
+
+  if(nwords < 6)
+    return;
+
+  header = bigendian_out ? drvSwap(event[3]) : event[3];
+  if((header >> 24) != 0xff)
+    return;
+  segment = bigendian_out ? drvSwap(event[4]) : event[4];
+  if((segment >> 24) >= 0x80)
+    return;
+  level  = header & 0xff;
+  number = bigendian_out ? drvSwap(event[5]) : event[5];
+
+  if(drvNextEvent && (number != drvNextEvent))
+    {
+      if(drvGaps++ < 10)
+	printf("rocDriver: ERROR: Event %u follows event %u\n",
+	       number, drvNextEvent - 1);
+      drvMissed += number - drvNextEvent;
+    }
+  drvNextEvent = number + level;
+}
+
+/* Output thread: poll the list for events from Go until End is done and
+   nothing more comes out */
+static void *
+drvOutput(void *arg)
+{
+  struct timespec ts = {0, 10000};
+  unsigned int *start = drvBuf, header;
+  unsigned long long t0;
+  int nwords, nempty = 0;
+
+  while(1)
+    {
+      drvRol->dabufp = (void *)start;
+      t0 = drvTimeNs();
+      (*drvPoll)();
+      t0 = drvTimeNs() - t0;
+      drvPolls++;
+
+      nwords = (unsigned int *)drvRol->dabufp - start;
+      if(nwords <= 0)
+	{
+	  drvEmpty++;
+	  if(drvStop && (nempty > DRV_DRAIN))
+	    break;
+	  /* Spin briefly, then sleep so the readout gets the CPU */
+	  if(nempty++ >= 100)
+	    nanosleep(&ts, NULL);
+	  continue;
+	}
+      nempty = 0;
+      drvPollNs += t0;
+
+      /* Past the end of drvBuf: memory after it may be gone already */
+      if(nwords > drvBufWords)
+	{
+	  printf("rocDriver: FATAL: Event of %d words, output buffer %d words\n",
+		 nwords, drvBufWords);
+	  abort();
+	}
+
+      header = drvHostHeader(start[1]) ? start[1] : drvSwap(start[1]);
+      drvTriggers += header & 0xff;
+      drvEvents++;
+      drvWords += nwords;
+
+      if(drvInCount)
+	{
+	  int nin = (*drvInCount)(), nout = (*drvOutCount)();
+
+	  if((drvInMin < 0) || (nin < drvInMin))
+	    drvInMin = nin;
+	  if(nout > drvOutMax)
+	    drvOutMax = nout;
+	  drvInSum  += nin;
+	  drvOutSum += nout;
+	}
+
+      drvSequence(start, nwords);
+
+      if(drvOut)
+	evioBlock(start, nwords, 0);
+
+      if(drvDelayUs)
+	usleep(drvDelayUs);
+    }
+
+  return NULL;
+}
+
+static double
+drvTransition(int daproc, char *name)
+{
+  unsigned long long t0 = drvTimeNs();
+
+  drvRol->daproc = daproc;
+  (*drvInit)(drvRol);
+
+  t0 = drvTimeNs() - t0;
+  printf("rocDriver: %-8s %10.3f ms\n", name, t0*1e-6);
+
+  return t0*1e-6;
+}
+
+static void
+drvSignal(int sig)
+{
+  drvInterrupt = 1;
+}
+
+static void
+drvUsage(char *prog)
+{
+  printf("Usage: %s [-n triggers] [-t seconds] [-r rate] [-c usrConfig] [-o file.evio]\n"
+	 "          [-b bytes] [-l lib.so] [-d us] list.so\n", prog);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *list, *config = NULL, *outname = NULL, *preload = NULL;
+  char sym[300], name[256], exe[4096], *dot;
+  unsigned long long ntrig = DRV_TRIGGERS, tgo, trun, tprint;
+  double tmax = 0, ttr[4], secs;
+  void *handle;
+  unsigned int *evlen;
+  int opt, n;
+
+  while((opt = getopt(argc, argv, "n:t:r:c:o:b:l:d:h")) != -1)
+    {
+      switch(opt)
+	{
+	case 'n':
+	  ntrig = strtoull(optarg, NULL, 0);
+	  break;
+	case 't':
+	  tmax = atof(optarg);
+	  break;
+	case 'r':
+	  setenv("EMU_TRIGGER_RATE", optarg, 1);
+	  break;
+	case 'c':
+	  config = optarg;
+	  break;
+	case 'o':
+	  outname = optarg;
+	  break;
+	case 'b':
+	  drvBufWords = strtol(optarg, NULL, 0)/4;
+	  break;
+	case 'd':
+	  drvDelayUs = atoi(optarg);
+	  break;
+	case 'l':
+	  preload = optarg;
+	  break;
+	default:
+	  drvUsage(argv[0]);
+	}
+    }
+  if((optind != argc - 1) || (drvBufWords < 1024))
+    drvUsage(argv[0]);
+  list = argv[optind];
+
+  /* Entry points <list>__init and <list>__poll, from the file name */
+  strncpy(name, basename(list), sizeof(name) - 1);
+  name[sizeof(name) - 1] = '\0';
+  if((dot = strstr(name, ".so")) != NULL)
+    *dot = '\0';
+
+  /* VME libraries for the list: -l, or lib/libemu.so next to rocDriver */
+  if(preload == NULL)
+    {
+      n = readlink("/proc/self/exe", exe, sizeof(exe) - 20);
+      if(n > 0)
+	{
+	  exe[n] = '\0';
+	  strcat(dirname(exe), "/lib/libemu.so");
+	  if(access(exe, R_OK) == 0)
+	    preload = exe;
+	}
+    }
+  if(preload && (dlopen(preload, RTLD_NOW | RTLD_GLOBAL) == NULL))
+    {
+      printf("rocDriver: ERROR: %s\n", dlerror());
+      return 1;
+    }
+
+  handle = dlopen(list, RTLD_NOW | RTLD_GLOBAL);
+  if(handle == NULL)
+    {
+      printf("rocDriver: ERROR: %s\n", dlerror());
+      return 1;
+    }
+  snprintf(sym, sizeof(sym), "%s__init", name);
+  drvInit = (rolEntry)dlsym(handle, sym);
+  snprintf(sym, sizeof(sym), "%s__poll", name);
+  drvPoll = (rolEntry)dlsym(handle, sym);
+  if((drvInit == NULL) || (drvPoll == NULL))
+    {
+      printf("rocDriver: ERROR: %s has no %s__init or %s__poll\n", list, name, name);
+      return 1;
+    }
+  drvInCount    = (rolCount)dlsym(handle, "getInQueueCount");
+  drvOutCount   = (rolCount)dlsym(handle, "getOutQueueCount");
+  drvErrCount   = (int *)dlsym(handle, "errCount");
+  drvEmptyCount = (int *)dlsym(handle, "emptyCount");
+  if(drvOutCount == NULL)
+    drvInCount = NULL;
+
+  drvBuf = (unsigned int *)calloc(drvBufWords + 1024, sizeof(unsigned int));
+  if(drvBuf == NULL)
+    {
+      perror("calloc");
+      return 1;
+    }
+
+  if(outname)
+    {
+      if((drvOut = fopen(outname, "w")) == NULL)
+	{
+	  perror(outname);
+	  return 1;
+	}
+      setvbuf(drvOut, NULL, _IOFBF, 4*1024*1024);
+    }
+
+  drvRol = (rolParam)calloc(1, sizeof(*drvRol));
+  drvRol->name      = name;
+  drvRol->usrConfig = config;
+  drvRol->nevents   = (void *)&drvNevents;
+  drvRol->async_roc = (void *)&drvAsyncRoc;
+  drvRol->dabufp    = (void *)drvBuf;
+
+  signal(SIGINT, drvSignal);
+
+  printf("rocDriver: %s, %llu triggers%s%s\n", list, ntrig,
+	 config ? ", usrConfig " : "", config ? config : "");
+
+  drvTransition(DA_INIT_PROC, "Init");
+  ttr[0] = drvTransition(DA_DOWNLOAD_PROC, "Download");
+  ttr[1] = drvTransition(DA_PRESTART_PROC, "Prestart");
+
+  /* Room for the largest event of the list, ROC bank header and all */
+  evlen = (unsigned int *)dlsym(handle, "rocEventLength");
+  if(evlen && (*evlen/4 + 64 > drvBufWords))
+    {
+      drvBufWords = *evlen/4 + 64;
+      free(drvBuf);
+      drvBuf = (unsigned int *)calloc(drvBufWords + 1024, sizeof(unsigned int));
+      if(drvBuf == NULL)
+	{
+	  perror("calloc");
+	  return 1;
+	}
+      drvRol->dabufp = (void *)drvBuf;
+      printf("rocDriver: Output buffer %d bytes, for event buffers of %u bytes\n",
+	     drvBufWords*4, *evlen);
+    }
+
+  ttr[2] = drvTransition(DA_GO_PROC, "Go");
+  tgo = tprint = drvTimeNs();
+  pthread_create(&drvPth, NULL, drvOutput, NULL);
+
+  while(!drvInterrupt && (drvTriggers < ntrig))
+    {
+      usleep(10000);
+      trun = drvTimeNs();
+      if((tmax > 0) && ((trun - tgo)*1e-9 > tmax))
+	break;
+      if(trun - tprint > 1000000000ULL)
+	{
+	  printf("rocDriver: %llu events, %llu triggers\n", drvEvents, drvTriggers);
+	  tprint = trun;
+	}
+    }
+
+  ttr[3] = drvTransition(DA_END_PROC, "End");
+  drvStop = 1;
+  pthread_join(drvPth, NULL);
+  trun = drvTimeNs() - tgo;
+
+  if(drvOut)
+    {
+      evioBlock(NULL, 0, 1);
+      fclose(drvOut);
+    }
+
+  secs = trun*1e-9;
+  printf("\nrocDriver: %s\n", list);
+  printf("  Download %.3f ms, Prestart %.3f ms, Go %.3f ms, End %.3f ms\n",
+	 ttr[0], ttr[1], ttr[2], ttr[3]);
+  printf("  Go to End %.3f s: %llu events, %llu triggers, %llu words\n",
+	 secs, drvEvents, drvTriggers, drvWords);
+  printf("  %.1f events/s, %.1f triggers/s, %.3f MB/s\n",
+	 drvEvents/secs, drvTriggers/secs, drvWords*4/secs/1e6);
+  printf("  %llu polls (%llu empty)\n", drvPolls, drvEmpty);
+  if(drvEvents)
+    printf("  %.2f us per event taken in %s__poll, %.1f MB/s\n",
+	   drvPollNs*1e-3/drvEvents, name, drvPollNs ? drvWords*4e3/drvPollNs : 0.);
+  if(drvInCount && drvEvents)
+    printf("  Free event buffers: min %d, mean %.1f.  Queued events: max %d, mean %.1f\n",
+	   drvInMin, (double)drvInSum/drvEvents, drvOutMax, (double)drvOutSum/drvEvents);
+  if(drvErrCount && drvEmptyCount)
+    printf("  No free buffer (errCount) %d, buffers ran out (emptyCount) %d\n",
+	   *drvErrCount, *drvEmptyCount);
+  if(drvGaps)
+    printf("  ERROR: %llu gaps in the event numbers, %llu events missing\n",
+	   drvGaps, drvMissed);
+  if(outname)
+    printf("  Events written to %s\n", outname);
+
+  return drvGaps ? 2 : 0;
+}
@@ -25,12 +25,16 @@
 #include "tiprimary_list.c" /* Source required for CODA readout lists using the TI */
 #include "fadcLib.h"        /* library of FADC250 routines */
 #include "sdLib.h"
+#include "rocWait.h"        /* Module block ready wait */
+#include "rocDmaSize.h"     /* Module block size from its configuration */
+#include "rocPulse.h"       /* Pulse parameters from the raw window data */
 
 /* Define initial blocklevel and buffering level */
 #define BLOCKLEVEL 1
 #define BUFFERLEVEL 4
 
 /* FADC Library Variables */
+static rocWaitStat faWait = {"FADC250"};
 extern int fadcA32Base, nfadc;
 #define NFADC     1
 /* Address of first fADC250 */
@@ -41,11 +45,19 @@ extern int fadcA32Base, nfadc;
 #define FADC_WINDOW_LAT    500
 #define FADC_WINDOW_WIDTH  460
 #define FADC_MODE           10
+#define FADC_READY_TIMEOUT 1000   /* Longest wait for an FADC block (us) */
 
 /* for the calculation of maximum data words in the block transfer */
 unsigned int MAXFADCWORDS=0;
 int useSD = 1;  /* Decision to use SD module */
 
+/* Modules that held up the End drain (rocEndStuckHook) */
+static void
+endStuck()
+{
+  rocWaitStuck(&faWait);
+}
+
 /****************************************
  *  DOWNLOAD
  ****************************************/
@@ -201,6 +213,23 @@ rocDownload()
   faGStatus(0);
   tiStatus(0);
 
+  /* Reduce the raw samples to pulse parameters (ROC_FADC_PULSE) */
+  rocPulseConfig();
+
+  rocEndStuckHook = endStuck;
+
+  /* Largest block this configuration can produce, to size the event buffers.
+     All of MAX_EVENT_LENGTH if an FADC mode is not known to faBlockWords() */
+  if(faGBlockWords(blockLevel))
+    rocSetEventLength(4*((8 + 5*blockLevel)                     /* TI trigger bank */
+			 + 6                                     /* Bank 5 */
+			 + 2 + (rocPulseMode == 2)                 /* Bank 3 */
+			 + nfadc*faGBlockWords(blockLevel)
+			 + ((rocPulseMode != 0) ?                  /* Bank 8 */
+			    3 + nfadc*faGBlockWords(blockLevel) : 0)));
+  else
+    rocSetEventLength(MAX_EVENT_LENGTH);
+
   printf("rocDownload: User Download Executed\n");
 
 }
@@ -271,10 +300,16 @@ rocGo()
 	All from 9, and raw window data (2 samples per word)
 	5 + blocklevel * (196 + WindowWidth / 2);
       */
-//      MAXFADCWORDS = 5 + blockLevel * (196 + (FADC_WINDOW_WIDTH >> 1) ) + 4; /* 4 = fudge */
-			MAXFADCWORDS = 4000;
+      MAXFADCWORDS = 5 + blockLevel * (196 + (FADC_WINDOW_WIDTH >> 1) ) + 4; /* 4 = fudge */
     }
 
+  /* Exact limit from the module configuration, if the mode is known */
+  if(faGBlockWords(blockLevel))
+    MAXFADCWORDS = faGBlockWords(blockLevel);
+
+  rocWaitClear(&faWait);
+  rocPulseClear();
+
   /*  Enable FADC */
   faGEnable(0, 0);
 
@@ -322,6 +357,9 @@ rocEnd()
 
   printf("rocEnd: Ended after %d blocks\n",tiGetIntCount());
 
+  rocWaitReport(&faWait);
+  rocPulseReport();
+
 }
 
 /****************************************
@@ -333,11 +371,11 @@ rocTrigger(int arg)
   int ii, islot;
   int ifa, nwords, blockError, stat, dCnt, len=0, idata;
   unsigned int val;
-  unsigned int *start;
+  unsigned int *start, *bank3;
   unsigned int datascan, scanmask, roCount;
 
-  /* Set TI output 1 high for diagnostics */
-  tiSetOutputPort(1,0,0,0);
+  /* Set TI output 1 high for diagnostics, if enabled */
+  ROC_DIAG_START;
 
   roCount = tiGetIntCount(); //Get the TI trigger count
 
@@ -345,9 +383,12 @@ rocTrigger(int arg)
      Trigger Block MUST be reaodut first */
   dCnt = tiReadTriggerBlock(dma_dabufp);
 
+  /* Raw samples kept for this block? (ROC_FADC_RAW_PRESCALE/TYPE) */
+  rocPulseRawBlock(dma_dabufp, dCnt);
+
   if(dCnt<=0)
     {
-      printf("No TI Trigger data or error.  dCnt = %d\n",dCnt);
+      rocErrLog(ROCERR_TI_READ, roCount, dCnt, 0, 0);
     }
   else
     { /* TI Data is already in a bank structure.  Bump the pointer */
@@ -363,27 +404,36 @@ rocTrigger(int arg)
   BANKCLOSE;
 
   /* fADC250 Readout */
+  bank3 = dma_dabufp;
   BANKOPEN(3,BT_UI4,blockLevel);
+  /* With bank 3 raw or reduced by block (ROC_FADC_PULSE 2), flag raw
+     (0xb0b0b0b5) or reduced (0xb0b0b0c5).  Mode 1 leaves bank 3 as it was. */
+  if(rocPulseMode == 2)
+    *dma_dabufp++ = LSWAP(0xb0b0b0b5);
 
   /* Mask of initialized modules */
   scanmask = faScanMask();
-  /* Check scanmask for block ready up to 100 times */
-  datascan = faGBready(scanmask, 100);
+  /* Wait for all modules in scanmask to have a block ready */
+  datascan = rocWaitReady(&faWait, faGBready, scanmask, FADC_READY_TIMEOUT);
   stat = (datascan == scanmask);
 
   if(stat)
     {
       for(ifa = 0; ifa < nfadc; ifa++)
 	{
-	  nwords = faReadBlock(faSlot(ifa), dma_dabufp, MAXFADCWORDS, 1);
+	  nwords = rocDmaLimit(MAXFADCWORDS, 16, roCount, faSlot(ifa));
+	  if(nwords > 0)
+	    nwords = faReadBlock(faSlot(ifa), dma_dabufp, nwords, 1);
+	  else if(rocDropBuf)  /* No room: empty the module, drop the block */
+	    faReadBlock(faSlot(ifa), rocDropBuf, MAXFADCWORDS, 1);
+	  rocPulseAdd(dma_dabufp, nwords);
 
 	  /* Check for ERROR in block read */
 	  blockError = faGetBlockError(1);
 
 	  if(blockError)
 	    {
-	      printf("ERROR: Slot %d: in transfer (event = %d), nwords = 0x%x\n",
-		     faSlot(ifa), roCount, nwords);
+	      rocErrLog(ROCERR_BLOCK, roCount, faSlot(ifa), nwords, 0);
 
 	      if(nwords > 0)
 		dma_dabufp += nwords;
@@ -396,13 +446,15 @@ rocTrigger(int arg)
     }
   else
     {
-      printf("ERROR: Event %d: Datascan != Scanmask  (0x%08x != 0x%08x)\n",
-	     roCount, datascan, scanmask);
+      rocErrLog(ROCERR_DATASCAN, roCount, datascan, scanmask, 0);
     }
   BANKCLOSE;
 
-  /* Set TI output 0 low */
-  tiSetOutputPort(0,0,0,0);
+  /* Pulse parameters of the raw samples, with or in place of bank 3 */
+  rocPulseBank(bank3, blockLevel, 0);
+
+  /* Set TI outputs low */
+  ROC_DIAG_STOP;
 
 }
 
@@ -21,6 +21,9 @@
 #define VETROC_SLOT 13					/* slot of first vetroc */
 #define VETROC_SLOT_INCR 1			/* slot increment */
 #define NVETROC	2								/* number of vetrocs used */
+#define VETROC_A32_BASE 0x0A000000	/* A32 base of the VETROC block data registers */
+#define VETROC_READY_TIMEOUT 1000  /* Longest wait for a VETROC block (us) */
+#define VETROC_ROMODE 1  /* Readout Mode: 0 = SCT, 1 = Single Board DMA, 2 = MultiBoard DMA */
 
 /* FADC definitions */
 #define USE_FADC
@@ -30,6 +33,7 @@
 #define FADC_WINDOW_LAT    500
 #define FADC_WINDOW_WIDTH  500
 #define FADC_MODE        		 1
+#define FADC_READY_TIMEOUT 1000   /* Longest wait for an FADC block (us) */
 
 /* Measured longest fiber length in system */
 #define FIBER_LATENCY_OFFSET 0x4A
@@ -44,17 +48,49 @@
 #include "vetrocLib.h"      /* VETROC library */
 #include "fadcLib.h"        /* library of FADC250 routines */
 #include "sdLib.h"
+#include "rocWait.h"        /* Module block ready wait */
+#include "rocDmaSize.h"     /* Module block size from its configuration */
+#include "rocPulse.h"       /* Pulse parameters from the raw window data */
+
+/* Most words in one VETROC read: MultiBoard DMA reads all boards at once */
+#if(VETROC_ROMODE==2)
+#define VETROC_READ_WORDS (nvetroc*MAXVETROCDATA)
+#else
+#define VETROC_READ_WORDS MAXVETROCDATA
+#endif
+
+/* Most words of bank 4: the bank header, then for each board the marker
+   and count words, the data, and a word to spare.  The FADC reads leave
+   this much room in the event buffer. */
+#define VETROC_BANK_WORDS (2 + NVETROC*(3 + MAXVETROCDATA))
+
+/* Bank 3 layouts.  Without the pulse reduction (ROC_FADC_PULSE 0) it is
+   as it always was: first word 0xb0b0b0b5, and the word count of each
+   FADC block written over the block header word.  The pulse reduction
+   needs the block header, so with it on each block follows its word
+   count, as the VETROC blocks of bank 4 do, and the first word is
+   FADC_BANK_MARKER. */
+#define FADC_BANK_MARKER 0xb0b0b0d5
 
 /* VETROC variables */
+static rocWaitStat vtWait = {"VETROC"};
 static unsigned int vetrocSlotMask=0;
 int nvetroc=0;		// number of vetrocs in the crate
-unsigned int *tdcbuf;
 extern int vetrocA32Base;                      /* Minimum VME A32 Address for use by VETROCs */
 
 /* FADC variables */
+static rocWaitStat faWait = {"FADC250"};
 extern int fadcA32Base, nfadc;
 unsigned int MAXFADCWORDS=0;	/* for calculation of max words in the block transfer */
 
+/* Modules that held up the End drain (rocEndStuckHook) */
+static void
+endStuck()
+{
+  rocWaitStuck(&faWait);
+  rocWaitStuck(&vtWait);
+}
+
 /****************************************
  *  DOWNLOAD
  ****************************************/
@@ -215,22 +251,23 @@ rocDownload()
 		All from 9, and raw window data (2 samples per word)
 		5 + blocklevel * (196 + WindowWidth / 2);
     */
-//    MAXFADCWORDS = 5 + blockLevel * (196 + (FADC_WINDOW_WIDTH >> 1) ) + 4; /* 4 = fudge */
-		MAXFADCWORDS = 4000;
+		MAXFADCWORDS = 5 + blockLevel * (196 + (FADC_WINDOW_WIDTH >> 1) ) + 4; /* 4 = fudge */
     }
+
+  /* Exact limit from the module configuration, if the mode is known */
+  if(faGBlockWords(blockLevel))
+    MAXFADCWORDS = faGBlockWords(blockLevel);
 #endif
 
   /*****************
    *   VETROC SETUP
    *****************/
 #ifdef USE_VETROC
-	tdcbuf = (unsigned int *)malloc(MAXVETROCDATA*sizeof(unsigned int));
-
 /* 0 = software synch-reset, FP input 1, internal clock */
 //	vtflag = 0x20;  /* FP 1  0x020;  MAY NEED TO BE CHANGED*/
 	vtflag = 0x111; /* vxs sync-reset, trigger, clock */
 
-	vetrocA32Base = 0x0A000000;
+	vetrocA32Base = VETROC_A32_BASE;
 	nvetroc = vetrocInit((VETROC_SLOT<<19),(VETROC_SLOT_INCR<<19) , NVETROC, vtflag);
 	if (nvetroc <= 0) {
 		printf("ERROR: no VETROC !!! \n");
@@ -249,6 +286,10 @@ rocDownload()
 		vetrocLinkReset(vetrocSlot(ivt));
 		vetrocClear(vetrocSlot(ivt));
 	}
+
+#if(VETROC_ROMODE==2)
+	vetrocEnableMultiBlock();
+#endif
 #endif
 /* Print status for all boards */
 #ifdef USE_VETROC
@@ -260,6 +301,26 @@ rocDownload()
 	sdStatus(0);
   tiStatus(0);
 
+#ifdef USE_FADC
+  /* Reduce the raw samples to pulse parameters (ROC_FADC_PULSE) */
+  rocPulseConfig();
+#endif
+
+  rocEndStuckHook = endStuck;
+
+  /* Largest block this configuration can produce, to size the event buffers */
+  rocSetEventLength(4*((8 + 5*blockLevel)                /* TI trigger bank */
+		       + 6                                 /* Bank 5 */
+#ifdef USE_FADC
+		       + 3 + nfadc*(1 + MAXFADCWORDS)      /* Bank 3 */
+		       + ((rocPulseMode != 0) ?            /* Bank 8 */
+			  3 + nfadc*(1 + MAXFADCWORDS) : 0)
+#endif
+#ifdef USE_VETROC
+		       + VETROC_BANK_WORDS                 /* Bank 4 */
+#endif
+		       ));
+
   printf("rocDownload: User Download Executed\n");
 }
 
@@ -300,9 +361,15 @@ rocGo()
   blockLevel = tiGetCurrentBlockLevel();
   printf("rocGo: Block Level set to %d\n",blockLevel);
 
+  rocWaitClear(&faWait);
+  rocWaitClear(&vtWait);
+  rocPulseClear();
+
 #ifdef USE_FADC
   /* Enable/Set Block Level on modules, if needed, here */
   faGSetBlockLevel(blockLevel);
+  if(faGBlockWords(blockLevel))
+    MAXFADCWORDS = faGBlockWords(blockLevel);
 
   /*  Enable FADC */
   faGEnable(0, 0);
@@ -356,6 +423,14 @@ rocEnd()
 
   printf("rocEnd: Ended after %d blocks\n",tiGetIntCount());
 
+#ifdef USE_FADC
+  rocWaitReport(&faWait);
+  rocPulseReport();
+#endif
+#ifdef USE_VETROC
+  rocWaitReport(&vtWait);
+#endif
+
 }
 
 /****************************************
@@ -364,14 +439,14 @@ rocEnd()
 void
 rocTrigger(int arg)
 {
-  int ii, gbready, itime, read_stat, stat;
-  int ivt, ifa, nwords_fa, nwords_vt, blockError, dCnt, len=0, idata;
+  int gbready, read_stat, stat;
+  int ivt, ifa, nwords_fa, nwords_vt, blockError, dCnt, len=0, idata, faskip;
   unsigned int val;
-  unsigned int *start;
+  unsigned int *start, *bank3;
   unsigned int datascan, scanmask, roCount;
 
-  /* Set TI output 1 high for diagnostics */
-  tiSetOutputPort(1,0,0,0);
+  /* Set TI output 1 high for diagnostics, if enabled */
+  ROC_DIAG_START;
 
   roCount = tiGetIntCount(); //Get the TI trigger count
 
@@ -379,9 +454,12 @@ rocTrigger(int arg)
      Trigger Block MUST be reaodut first */
   dCnt = tiReadTriggerBlock(dma_dabufp);
 
+  /* Raw samples kept for this block? (ROC_FADC_RAW_PRESCALE/TYPE) */
+  rocPulseRawBlock(dma_dabufp, dCnt);
+
   if(dCnt<=0)
 	{
-  	printf("No TI Trigger data or error.  dCnt = %d\n",dCnt);
+  	rocErrLog(ROCERR_TI_READ, roCount, dCnt, 0, 0);
 	}
   else
   { /* TI Data is already in a bank structure.  Bump the pointer */
@@ -398,44 +476,56 @@ rocTrigger(int arg)
 
 #ifdef USE_FADC
 	/* fADC250 Readout */
+  bank3 = dma_dabufp;
   BANKOPEN(3,BT_UI4,blockLevel);
-	*dma_dabufp++ = LSWAP(0xb0b0b0b5); /* First word */
+	*dma_dabufp++ = LSWAP(rocPulseMode ? FADC_BANK_MARKER : 0xb0b0b0b5); /* First word */
+	faskip = (rocPulseMode != 0);
 
   /* Mask of initialized modules */
   scanmask = faScanMask();
-  /* Check scanmask for block ready up to 100 times */
-  datascan = faGBlockReady(scanmask, 100);
+  /* Wait for all modules in scanmask to have a block ready */
+  datascan = rocWaitReady(&faWait, faGBready, scanmask, FADC_READY_TIMEOUT);
   stat = (datascan == scanmask);
 
 	if(stat)
   {
   	for(ifa = 0; ifa < nfadc; ifa++)
 		{
-	  	nwords_fa = faReadBlock(faSlot(ifa), dma_dabufp, MAXFADCWORDS, 1);
+	  	nwords_fa = rocDmaLimit(MAXFADCWORDS, 16 + VETROC_BANK_WORDS,
+					roCount, faSlot(ifa));
+	  	/* skip 1 word (pulse reduction on) so nwords_fa is written before
+	  	   the data, or write it over the block header */
+	  	if(nwords_fa > 0)
+	  	  nwords_fa = faReadBlock(faSlot(ifa), dma_dabufp + faskip, nwords_fa, 1);
+	  	else if(rocDropBuf)  /* No room: empty the module, drop the block */
+	  	  faReadBlock(faSlot(ifa), rocDropBuf, MAXFADCWORDS, 1);
 			*dma_dabufp++ = LSWAP(nwords_fa);
+			rocPulseAdd(dma_dabufp, nwords_fa);
 
 	  	/* Check for ERROR in block read */
 	  	blockError = faGetBlockError(1);
 
 	  	if(blockError)
 	    {
-	    	printf("ERROR: Slot %d: in transfer (event = %d), nwords = 0x%x\n",
-		    faSlot(ifa), roCount, nwords_fa);
+	    	rocErrLog(ROCERR_BLOCK, roCount, faSlot(ifa), nwords_fa, 0);
 
 	      if(nwords_fa > 0)
-					dma_dabufp += nwords_fa-1;
+					dma_dabufp += nwords_fa - 1 + faskip;
 	    }
-	  	else
+	  	else if(nwords_fa > 0)
 	    {
-	      dma_dabufp += nwords_fa-1;
+	      dma_dabufp += nwords_fa - 1 + faskip;
 	    }
 		}
 	}
   else
   {
-  	printf("ERROR: Event %d: Datascan != Scanmask  (0x%08x != 0x%08x)\n", roCount, datascan, scanmask);
+  	rocErrLog(ROCERR_DATASCAN, roCount, datascan, scanmask, 0);
   }
   BANKCLOSE;
+
+  /* Pulse parameters of the raw samples, with or in place of bank 3 */
+  rocPulseBank(bank3, blockLevel, 16 + VETROC_BANK_WORDS);
 #endif
 
 #ifdef USE_VETROC
@@ -443,40 +533,41 @@ rocTrigger(int arg)
 	BANKOPEN(4,BT_UI4,0);
 
 	/* Check for valid data in VETROC */
-	read_stat = 0;
-
-	for(itime=0; itime<1000; itime++)
-	{
-		gbready = vetrocGBready();
-		read_stat = (gbready == vetrocSlotMask);
-
-		if (read_stat>0)
-		{
-			break;
-		}
-   }
+	gbready = rocWaitReady(&vtWait, vetrocGBready, vetrocSlotMask,
+			       VETROC_READY_TIMEOUT);
+	read_stat = (gbready == vetrocSlotMask);
 
 	if(read_stat>0)
-	{ /* read the data here */
+	{ /* read the data here, straight into the event buffer */
+#if(VETROC_ROMODE==2)
+		ivt = 0;
+#else
 		for(ivt=0; ivt<nvetroc; ivt++)
+#endif
 		{
-			nwords_vt = vetrocReadFIFO(vetrocSlot(ivt), &tdcbuf[0], MAXVETROCDATA, 1);
-
 			*dma_dabufp++ = LSWAP(0xb0b0b0b4); /* First word */
-			*dma_dabufp++ = LSWAP(nwords_vt);
 
-			for (ii=0; ii<nwords_vt; ii++)
-			{
-  			*dma_dabufp++ = tdcbuf[ii];
+			/* skip 1 word so nwords_vt is written before the data.  Keep
+			   room for the marker and count of the boards after this one */
+			nwords_vt = rocDmaLimit(VETROC_READ_WORDS, 1 + 2*(nvetroc - ivt - 1),
+						roCount, vetrocSlot(ivt));
+			if(nwords_vt > 0)
+				nwords_vt = vetrocReadBlock(vetrocSlot(ivt), dma_dabufp + 1, nwords_vt,
+							 VETROC_ROMODE);
+			else if(rocDropBuf)  /* No room: empty the board, drop the block */
+				vetrocReadBlock(vetrocSlot(ivt), rocDropBuf, VETROC_READ_WORDS,
+						VETROC_ROMODE);
+			*dma_dabufp++ = LSWAP(nwords_vt);
 
-			}
+			if(nwords_vt > 0)
+				dma_dabufp += nwords_vt;
 		}
 	}
 	BANKCLOSE;
 #endif
 
-  /* Set TI output 0 low */
-  tiSetOutputPort(0,0,0,0);
+  /* Set TI outputs low */
+  ROC_DIAG_STOP;
 
 }
 
@@ -0,0 +1,146 @@
+/*************************************************************************
+ *
+ *  rocDmaAlign.h - 64-bit aligned module DMA destinations
+ *
+ *  Usage (in a readout list, after including tiprimary_list.c):
+ *
+ *    #include "rocDmaAlign.h"
+ *
+ *    rocDownload(): rocDmaAlign = rocConfigInt("ROC_DMA_ALIGN", DMA_ALIGN);
+ *    rocGo():       rocDmaBenchClear();
+ *    rocTrigger():  align = rocDmaAlignBlock();
+ *                   *dma_dabufp++ = LSWAP(rocDmaMarker(0xb0b0b0b5, align));
+ *                   ...
+ *                   skip = rocDmaSkip(align);
+ *                   t = rocTimeNs();
+ *                   nwords = faReadBlock(slot, dma_dabufp + skip, max, 1);
+ *                   rocDmaBench(dma_dabufp + skip, nwords, t);
+ *                   rocDmaCount(nwords, skip);
+ *                   dma_dabufp += nwords;
+ *    rocEnd():      rocDmaBenchReport();
+ *
+ *  Each module block in a bank is written as its word count followed by
+ *  the data.  The data lands on an 8-byte boundary only if the words
+ *  before it happen to be even.  With padding on, rocDmaSkip() returns 2
+ *  when dma_dabufp + 1 is not 8-byte aligned, and rocDmaCount() then
+ *  writes DMA_PAD_WORD between the count and the data and sets
+ *  DMA_PAD_FLAG in the count.  A bank written with padding on has
+ *  0xa0 in place of 0xb0 in the low byte of its first word
+ *  (0xb0b0b0b5 -> 0xb0b0b0a5), so a decoder can tell the two layouts
+ *  apart.
+ *
+ *  ROC_DMA_ALIGN:  0  no padding (the original layout)
+ *                  1  pad every block
+ *                  2  pad every other block, to compare the two
+ *
+ *  rocDmaBench() adds the time and words of each transfer to the
+ *  aligned or the unaligned total, from the destination it was given.
+ *  rocDmaBenchReport() prints the rate of each at End.
+ *
+ *************************************************************************/
+
+#ifndef __ROCDMAALIGN_H
+#define __ROCDMAALIGN_H
+
+#ifndef DMA_ALIGN
+#define DMA_ALIGN 0
+#endif
+#define DMA_PAD_FLAG 0x80000000  /* In the word count: a pad word follows */
+#define DMA_PAD_WORD 0xb0b0b0bf
+
+typedef struct
+{
+  unsigned int        calls;   /* Transfers */
+  unsigned long long  words;   /* Words transferred */
+  unsigned long long  ns;      /* Time in the transfers */
+} rocDmaStat;
+
+int rocDmaAlign=DMA_ALIGN;
+static unsigned int rocDmaBlocks=0;
+static rocDmaStat rocDmaBenchStat[2];  /* [0] unaligned, [1] aligned */
+
+/* Pad the module blocks of this trigger? */
+static inline int
+rocDmaAlignBlock()
+{
+  switch(rocDmaAlign)
+    {
+    case 0:
+      return 0;
+    case 1:
+      return 1;
+    default:
+      return (rocDmaBlocks++) & 1;
+    }
+}
+
+/* Bank first word, flagged when the bank is padded */
+static inline unsigned int
+rocDmaMarker(unsigned int marker, int align)
+{
+  return align ? ((marker & ~0xf0) | 0xa0) : marker;
+}
+
+/* Words between dma_dabufp (the word count) and the module data */
+static inline int
+rocDmaSkip(int align)
+{
+  if(align && (((unsigned long)(dma_dabufp + 1)) & 0x7))
+    return 2;
+
+  return 1;
+}
+
+/* Write the word count (and pad word) in front of the module data.
+   A failed transfer (nwords <= 0) is written without the pad. */
+static inline void
+rocDmaCount(int nwords, int skip)
+{
+  if((nwords > 0) && (skip == 2))
+    {
+      *dma_dabufp++ = LSWAP(nwords | DMA_PAD_FLAG);
+      *dma_dabufp++ = LSWAP(DMA_PAD_WORD);
+    }
+  else
+    *dma_dabufp++ = LSWAP(nwords);
+}
+
+static inline void
+rocDmaBench(volatile unsigned int *dest, int nwords, unsigned long long start)
+{
+  rocDmaStat *st = &rocDmaBenchStat[(((unsigned long)dest) & 0x7) ? 0 : 1];
+
+  if(nwords <= 0)
+    return;
+
+  st->calls++;
+  st->words += nwords;
+  st->ns    += rocTimeNs() - start;
+}
+
+static void
+rocDmaBenchClear()
+{
+  rocDmaBlocks = 0;
+  memset(rocDmaBenchStat, 0, sizeof(rocDmaBenchStat));
+}
+
+static void
+rocDmaBenchReport()
+{
+  int ia;
+  rocDmaStat *st;
+  const char *name[2] = {"unaligned", "aligned"};
+
+  printf("DMA transfers (ROC_DMA_ALIGN %d):\n", rocDmaAlign);
+  for(ia = 1; ia >= 0; ia--)
+    {
+      st = &rocDmaBenchStat[ia];
+      printf("  %-9s %10u transfers, %12llu words, %8.1f MB/s, %.2f us/transfer\n",
+	     name[ia], st->calls, st->words,
+	     st->ns ? (st->words*4*1000.)/st->ns : 0.,
+	     st->calls ? (st->ns/1000.)/st->calls : 0.);
+    }
+}
+
+#endif /* __ROCDMAALIGN_H */
@@ -0,0 +1,101 @@
+/*************************************************************************
+ *
+ *  rocDmaSize.h - Largest block a module can send, from its configuration
+ *
+ *  Usage (in a readout list, after the modules are configured):
+ *
+ *    #include "rocDmaSize.h"
+ *
+ *    rocDownload(): rocSetEventLength(... faBlockWords(faSlot(ifa), level) ...);
+ *    rocGo():       MAXFADCWORDS = faGBlockWords(blockLevel);
+ *                   MAXVETROCDATA = vetrocBlockWords(blockLevel, hits);
+ *
+ *  faBlockWords() reads back the processing mode, window width (PTW),
+ *  number of pulses (NP) and channel mask of an FADC250 and returns the
+ *  most words it can send for a block of level events:
+ *
+ *    block header + block trailer + 2 filler words
+ *    + level * (event header + 2 trigger time words + event trailer
+ *               + enabled channels * words per channel)
+ *
+ *  words per channel:
+ *     mode 1  (raw window)        1 + PTW/2       (2 samples per word)
+ *     mode 9  (pulse parameters)  1 + 3*NP
+ *     mode 10 (9 + raw window)    2 + PTW/2 + 3*NP
+ *
+ *  For any other mode it returns 0, and the list keeps its fixed limit.
+ *
+ *  A VETROC has no hit limit to read back, so vetrocBlockWords() takes
+ *  the most TDC words a board may send for one event (one per edge)
+ *  from the list (ROC_VETROC_MAX_HITS):
+ *
+ *    block header + block trailer + 2 filler words
+ *    + level * (event header + 2 trigger time words + hits)
+ *
+ *************************************************************************/
+
+#ifndef __ROCDMASIZE_H
+#define __ROCDMASIZE_H
+
+#define FA_NCHAN 16
+
+extern int nfadc;
+
+static int
+faBlockWords(int slot, int level)
+{
+  int pmode, ich, nch = 0, chanwords;
+  unsigned int PL, PTW, NSB, NSA, NP, chmask;
+
+  if(faGetProcMode(slot, &pmode, &PL, &PTW, &NSB, &NSA, &NP) != OK)
+    return 0;
+
+  chmask = faGetChannelMask(slot, 0);
+  for(ich = 0; ich < FA_NCHAN; ich++)
+    if(chmask & (1 << ich))
+      nch++;
+
+  switch(pmode)
+    {
+    case 1:
+      chanwords = 1 + (PTW + 1)/2;
+      break;
+    case 9:
+      chanwords = 1 + 3*NP;
+      break;
+    case 10:
+      chanwords = 2 + (PTW + 1)/2 + 3*NP;
+      break;
+    default:
+      return 0;
+    }
+
+  return 4 + level*(4 + nch*chanwords);
+}
+
+/* Largest of all initialized FADC250s, 0 if any is unknown */
+static int
+faGBlockWords(int level)
+{
+  int ifa, nwords, rval = 0;
+
+  for(ifa = 0; ifa < nfadc; ifa++)
+    {
+      nwords = faBlockWords(faSlot(ifa), level);
+      if(nwords == 0)
+	return 0;
+      if(nwords > rval)
+	rval = nwords;
+    }
+
+  return rval;
+}
+
+/* Largest VETROC block of level events of at most hits TDC words each */
+static inline int
+vetrocBlockWords(int level, int hits)
+{
+  return 4 + level*(3 + hits);
+}
+
+#endif /* __ROCDMASIZE_H */
@@ -0,0 +1,153 @@
+/*************************************************************************
+ *
+ *  rocProfile.h - Per-phase latency profiler for rocTrigger()
+ *
+ *  Usage (in a readout list, after including tiprimary_list.c):
+ *
+ *    #define ROC_PROFILE          (leave undefined to compile it out)
+ *    #include "rocProfile.h"
+ *
+ *    rocGo():       PROF_INIT(nphases, phase_names);
+ *    rocTrigger():  PROF_START;
+ *                   ... readout of phase i ...
+ *                   PROF_MARK(i);
+ *                   ...
+ *                   PROF_STOP;
+ *    rocEnd():      PROF_REPORT;
+ *
+ *  Each PROF_MARK stores the time (ns, CLOCK_MONOTONIC) and the number
+ *  of words written to dma_dabufp since the previous mark.  Blocks are
+ *  kept in a preallocated ring of ROC_PROFILE_NBLOCKS entries; at End
+ *  p50/p95/p99/max of the time and the mean/max words of each phase are
+ *  printed for the blocks in the ring.
+ *
+ *************************************************************************/
+
+#ifndef __ROCPROFILE_H
+#define __ROCPROFILE_H
+
+#ifdef ROC_PROFILE
+
+#include <time.h>
+#include <stdlib.h>
+
+#ifndef ROC_PROFILE_NBLOCKS
+#define ROC_PROFILE_NBLOCKS 16384  /* Blocks kept for the report */
+#endif
+#define ROC_PROFILE_NPHASE  8      /* Most phases per block */
+
+typedef struct
+{
+  unsigned int ns[ROC_PROFILE_NPHASE];
+  unsigned int words[ROC_PROFILE_NPHASE];
+} rocProfileBlock;
+
+static rocProfileBlock rocProf[ROC_PROFILE_NBLOCKS];
+static unsigned int rocProfSort[ROC_PROFILE_NBLOCKS];
+static unsigned int rocProfCount = 0;    /* Blocks recorded this run */
+static int rocProfNphase = 0;
+static const char **rocProfName = NULL;
+static struct timespec rocProfTime;      /* Time of the last mark */
+static volatile unsigned int *rocProfBufp; /* dma_dabufp at the last mark */
+
+static void
+rocProfileInit(int nphase, const char **names)
+{
+  if(nphase > ROC_PROFILE_NPHASE)
+    nphase = ROC_PROFILE_NPHASE;
+
+  rocProfNphase = nphase;
+  rocProfName   = names;
+  rocProfCount  = 0;
+  memset(rocProf, 0, sizeof(rocProf));
+}
+
+static inline void
+rocProfileStart()
+{
+  clock_gettime(CLOCK_MONOTONIC, &rocProfTime);
+  rocProfBufp = dma_dabufp;
+}
+
+static inline void
+rocProfileMark(int phase)
+{
+  struct timespec now;
+  rocProfileBlock *blk = &rocProf[rocProfCount % ROC_PROFILE_NBLOCKS];
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  blk->ns[phase] = (now.tv_sec - rocProfTime.tv_sec)*1000000000 +
+    (now.tv_nsec - rocProfTime.tv_nsec);
+  blk->words[phase] = dma_dabufp - rocProfBufp;
+
+  rocProfTime = now;
+  rocProfBufp = dma_dabufp;
+}
+
+static inline void
+rocProfileStop()
+{
+  rocProfCount++;
+}
+
+static int
+rocProfileCompare(const void *a, const void *b)
+{
+  unsigned int ua = *(const unsigned int *)a, ub = *(const unsigned int *)b;
+
+  return (ua > ub) - (ua < ub);
+}
+
+static void
+rocProfileReport()
+{
+  int iph;
+  unsigned int ib, nblk, wmax;
+  double wsum;
+
+  nblk = (rocProfCount < ROC_PROFILE_NBLOCKS) ? rocProfCount : ROC_PROFILE_NBLOCKS;
+  if(nblk == 0)
+    return;
+
+  printf("rocProfile: %d blocks (last %d kept)\n", rocProfCount, nblk);
+  printf("  %-12s %10s %10s %10s %10s %10s %10s\n",
+	 "phase", "p50(ns)", "p95(ns)", "p99(ns)", "max(ns)", "words", "maxwords");
+
+  for(iph = 0; iph < rocProfNphase; iph++)
+    {
+      wsum = 0; wmax = 0;
+      for(ib = 0; ib < nblk; ib++)
+	{
+	  rocProfSort[ib] = rocProf[ib].ns[iph];
+	  wsum += rocProf[ib].words[iph];
+	  if(rocProf[ib].words[iph] > wmax)
+	    wmax = rocProf[ib].words[iph];
+	}
+      qsort(rocProfSort, nblk, sizeof(unsigned int), rocProfileCompare);
+
+      printf("  %-12s %10u %10u %10u %10u %10.1f %10u\n",
+	     rocProfName ? rocProfName[iph] : "",
+	     rocProfSort[(nblk*50)/100], rocProfSort[(nblk*95)/100],
+	     rocProfSort[(nblk*99)/100], rocProfSort[nblk-1],
+	     wsum/nblk, wmax);
+    }
+}
+
+#define PROF_INIT(__n,__names) rocProfileInit(__n,__names)
+#define PROF_START             rocProfileStart()
+#define PROF_MARK(__ph)        rocProfileMark(__ph)
+#define PROF_STOP              rocProfileStop()
+#define PROF_REPORT            rocProfileReport()
+
+#else /* ROC_PROFILE */
+
+#define PROF_INIT(__n,__names)
+#define PROF_START
+#define PROF_MARK(__ph)
+#define PROF_STOP
+#define PROF_REPORT
+
+#endif /* ROC_PROFILE */
+
+#endif /* __ROCPROFILE_H */
@@ -0,0 +1,562 @@
+/*************************************************************************
+ *
+ *  rocPulse.h - Pulse parameters from fADC250 raw window data
+ *
+ *  Usage (in a readout list, after including tiprimary_list.c):
+ *
+ *    #include "rocPulse.h"
+ *
+ *    rocDownload(): rocPulseConfig();
+ *    rocGo():       rocPulseClear();
+ *    rocTrigger():  dCnt = tiReadTriggerBlock(dma_dabufp);
+ *                   rocPulseRawBlock(dma_dabufp, dCnt);
+ *                   ...
+ *                   bank3 = dma_dabufp;
+ *                   BANKOPEN(3,BT_UI4,blockLevel);
+ *                   ...
+ *                   nwords = faReadBlock(slot, dma_dabufp, max, 1);
+ *                   rocPulseAdd(dma_dabufp, nwords);
+ *                   ...
+ *                   BANKCLOSE;
+ *                   rocPulseBank(bank3, blockLevel, reserve);
+ *    rocEnd():      rocPulseReport();
+ *
+ *  The fADC250 keeps running in a raw mode (1 or 10).  rocPulseBank()
+ *  decodes the window raw data (type 4) of the module blocks given to
+ *  rocPulseAdd() and writes one reduced block for each block read:
+ *
+ *    block header, event header, trigger time words   as read
+ *    for each channel with a sample over threshold:
+ *      0xD0000000 | channel<<23 | saturated<<22 | not valid<<21 | pedestal*4
+ *      integral over the window, pedestal subtracted (bits 29-0)
+ *      peak sample<<16 | peak, pedestal subtracted (bits 12-0)
+ *      first sample over threshold<<16 | samples over threshold
+ *    block trailer                                    words of the reduced block
+ *    filler                                           to an even number of words
+ *
+ *  The pedestal is the mean of the first ROC_FADC_PULSE_NPED samples, the
+ *  threshold ROC_FADC_PULSE_TET counts over it.  Channels without a
+ *  sample over threshold are left out, and so are the pulse parameter
+ *  words of mode 10.
+ *
+ *  ROC_FADC_PULSE:  0  raw data only (the original layout)
+ *                   1  raw data in bank 3, reduced blocks in bank 8
+ *                      (first word 0xb0b0b0b8)
+ *                   2  reduced blocks in place of the raw data: bank 3
+ *                      with first word 0xb0b0b0c5
+ *
+ *  A reduced bank (3 or 8) is its first word, then the reduced blocks
+ *  one after the other.  Unlike the raw bank 3 of the merge and
+ *  vtpCompton lists, it has no word count before each block and no
+ *  DMA pad words (rocDmaAlign.h): the trailer of each reduced block
+ *  holds its word count, filler not included, and a block of an odd
+ *  number of words is followed by one filler word (0xF8000000 | slot<<22).
+ *  With a multiboard DMA the blocks of all modules follow each other
+ *  in the same way.
+ *
+ *  When the reduced blocks do not fit in the event buffer the raw data
+ *  is kept as it is.
+ *
+ *  With ROC_FADC_RAW_PRESCALE N (and ROC_FADC_PULSE 2, which it turns
+ *  on) the raw data of every Nth block is kept, and so is that of a
+ *  block with an event of type ROC_FADC_RAW_TYPE in its TI trigger bank.
+ *  The first word of bank 3 tells them apart: 0xb0b0b0b5 for raw data
+ *  (0xb0b0b0a5 if padded, see rocDmaAlign.h, and 0xb0b0b0d5 from
+ *  merge_vetroc_fadc_list.c, whose raw bank 3 changes layout with the
+ *  pulse reduction on), 0xb0b0b0c5 for reduced.
+ *
+ *  The window sums are taken 8 (AVX2) or 4 (SSE2) sample words at a time
+ *  on an x86 controller, where the big endian module data is swapped to
+ *  host order 16 bits at a time.  ROC_FADC_PULSE_SIMD picks the code:
+ *  -1 the best the CPU has, 0 scalar, 1 SSE2, 2 AVX2.  Both vector
+ *  paths are built with target attributes and used only if the CPU has
+ *  them, so an i686 build needs no -msse2 and still runs on a CPU
+ *  without SSE2.
+ *  rocPulseReport() prints the words in and out and the time taken.
+ *
+ *************************************************************************/
+
+#ifndef __ROCPULSE_H
+#define __ROCPULSE_H
+
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+/* The readout list has its own __pause() (the Pause transition) */
+#define __pause __rocPulse_ia32_pause
+#include <immintrin.h>
+#undef __pause
+#define PULSE_X86
+#endif
+
+#ifndef FADC_PULSE
+#define FADC_PULSE      0
+#endif
+#ifndef FADC_PULSE_NPED
+#define FADC_PULSE_NPED 4    /* Samples in the pedestal */
+#endif
+#ifndef FADC_PULSE_TET
+#define FADC_PULSE_TET  20   /* Threshold over the pedestal (counts) */
+#endif
+#ifndef FADC_RAW_PRESCALE
+#define FADC_RAW_PRESCALE 0  /* Raw data kept for 1 in N blocks, 0: none */
+#endif
+#ifndef FADC_RAW_TYPE
+#define FADC_RAW_TYPE   0    /* Raw data kept for this event type, 0: none */
+#endif
+#define PULSE_BANK        8
+#define PULSE_MARKER      0xb0b0b0b8  /* First word of bank 8 */
+#define PULSE_MARKER3     0xb0b0b0c5  /* First word of a reduced bank 3 */
+#define PULSE_MAX_RANGES  32
+#define PULSE_WORDS       4           /* Words per channel */
+
+/* Window sums of a run of sample words */
+typedef struct
+{
+  unsigned int sum;    /* Samples */
+  unsigned int max;    /* Largest sample */
+  unsigned int over;   /* Samples over the threshold */
+  unsigned int flags;  /* Not valid bits seen */
+} rocPulseSums;
+
+typedef void (*rocPulseSumFunc)(unsigned int *data, int nw, unsigned int thr,
+				rocPulseSums *s);
+
+int rocPulseMode=FADC_PULSE;
+static int rocPulseNped=FADC_PULSE_NPED;
+static int rocPulseTet=FADC_PULSE_TET;
+static int rocPulsePrescale=FADC_RAW_PRESCALE;
+static int rocPulseRawType=FADC_RAW_TYPE;
+static int rocPulseKeep=0;  /* This block keeps its raw data: 1 prescale, 2 event type */
+
+static unsigned int *rocPulseRange[PULSE_MAX_RANGES];
+static int rocPulseRangeWords[PULSE_MAX_RANGES];
+static int rocPulseNrange=0;
+
+static unsigned int rocPulseBlocks=0, rocPulseFull=0;
+static unsigned int rocPulseSeq=0, rocPulseRaw[3];
+static unsigned long long rocPulseWordsIn=0, rocPulseWordsOut=0, rocPulseNs=0;
+
+static void
+rocPulseSumScalar(unsigned int *data, int nw, unsigned int thr, rocPulseSums *s)
+{
+  int iw;
+  unsigned int w, s0, s1;
+
+  for(iw = 0; iw < nw; iw++)
+    {
+      w  = LSWAP(data[iw]);
+      s0 = (w >> 16) & 0x1fff;
+      s1 = w & 0x1fff;
+
+      s->flags |= w & 0x20002000;
+      s->sum   += s0 + s1;
+      if(s0 > s->max)
+	s->max = s0;
+      if(s1 > s->max)
+	s->max = s1;
+      s->over  += (s0 > thr) + (s1 > thr);
+    }
+}
+
+#ifdef PULSE_X86
+/* Add the lanes of the vector sums to s */
+static void
+rocPulseLanes(unsigned int *sum, unsigned short *max, unsigned short *over,
+	      unsigned short *flags, int n16, rocPulseSums *s)
+{
+  int i;
+
+  for(i = 0; i < n16/2; i++)
+    s->sum += sum[i];
+  for(i = 0; i < n16; i++)
+    {
+      if(max[i] > s->max)
+	s->max = max[i];
+      s->over  += over[i];
+      s->flags |= flags[i] & 0x2000;
+    }
+}
+
+__attribute__((target("sse2")))
+static void
+rocPulseSumSse2(unsigned int *data, int nw, unsigned int thr, rocPulseSums *s)
+{
+  const __m128i mask = _mm_set1_epi16(0x1fff), one = _mm_set1_epi16(1);
+  const __m128i vthr = _mm_set1_epi16(thr);
+  __m128i x, v, sum, max, over, flags;
+  unsigned int lsum[4];
+  unsigned short lmax[8], lover[8], lflags[8];
+  int iw;
+
+  sum = max = over = flags = _mm_setzero_si128();
+  for(iw = 0; iw + 4 <= nw; iw += 4)
+    {
+      x = _mm_loadu_si128((__m128i *)&data[iw]);
+      /* Big endian words: a byte swap of each 16 bits leaves the samples
+	 in order */
+      x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+      flags = _mm_or_si128(flags, x);
+      v     = _mm_and_si128(x, mask);
+      sum   = _mm_add_epi32(sum, _mm_madd_epi16(v, one));
+      max   = _mm_max_epi16(max, v);
+      over  = _mm_sub_epi16(over, _mm_cmpgt_epi16(v, vthr));
+    }
+
+  _mm_storeu_si128((__m128i *)lsum, sum);
+  _mm_storeu_si128((__m128i *)lmax, max);
+  _mm_storeu_si128((__m128i *)lover, over);
+  _mm_storeu_si128((__m128i *)lflags, flags);
+  rocPulseLanes(lsum, lmax, lover, lflags, 8, s);
+
+  rocPulseSumScalar(&data[iw], nw - iw, thr, s);
+}
+
+__attribute__((target("avx2")))
+static void
+rocPulseSumAvx2(unsigned int *data, int nw, unsigned int thr, rocPulseSums *s)
+{
+  const __m256i mask = _mm256_set1_epi16(0x1fff), one = _mm256_set1_epi16(1);
+  const __m256i vthr = _mm256_set1_epi16(thr);
+  __m256i x, v, sum, max, over, flags;
+  unsigned int lsum[8];
+  unsigned short lmax[16], lover[16], lflags[16];
+  int iw;
+
+  sum = max = over = flags = _mm256_setzero_si256();
+  for(iw = 0; iw + 8 <= nw; iw += 8)
+    {
+      x = _mm256_loadu_si256((__m256i *)&data[iw]);
+      x = _mm256_or_si256(_mm256_slli_epi16(x, 8), _mm256_srli_epi16(x, 8));
+      flags = _mm256_or_si256(flags, x);
+      v     = _mm256_and_si256(x, mask);
+      sum   = _mm256_add_epi32(sum, _mm256_madd_epi16(v, one));
+      max   = _mm256_max_epi16(max, v);
+      over  = _mm256_sub_epi16(over, _mm256_cmpgt_epi16(v, vthr));
+    }
+
+  _mm256_storeu_si256((__m256i *)lsum, sum);
+  _mm256_storeu_si256((__m256i *)lmax, max);
+  _mm256_storeu_si256((__m256i *)lover, over);
+  _mm256_storeu_si256((__m256i *)lflags, flags);
+  rocPulseLanes(lsum, lmax, lover, lflags, 16, s);
+
+  rocPulseSumScalar(&data[iw], nw - iw, thr, s);
+}
+#endif /* PULSE_X86 */
+
+static rocPulseSumFunc rocPulseSum = rocPulseSumScalar;
+static const char *rocPulseSimd = "scalar";
+
+/* Sample isamp of a window */
+static inline unsigned int
+rocPulseSample(unsigned int *data, int isamp)
+{
+  unsigned int w = LSWAP(data[isamp >> 1]);
+
+  return (isamp & 1) ? (w & 0x1fff) : ((w >> 16) & 0x1fff);
+}
+
+/* Pulse words of the window of channel ch (nsamp samples at data) into
+   out.  Returns the words written, 0 with no sample over threshold. */
+static int
+rocPulseChannel(unsigned int *data, int ch, int nsamp, unsigned int *out)
+{
+  rocPulseSums s;
+  int isamp, nped, peak = -1, cross = -1;
+  unsigned int pedsum = 0, ped4, ped, thr, x, height;
+  long long integral;
+
+  nped = (rocPulseNped < nsamp) ? rocPulseNped : nsamp;
+  if(nped <= 0)
+    return 0;
+
+  for(isamp = 0; isamp < nped; isamp++)
+    pedsum += rocPulseSample(data, isamp);
+  ped4 = (4*pedsum + nped/2)/nped;
+  ped  = (ped4 + 2)/4;
+  thr  = ped + rocPulseTet;
+
+  memset(&s, 0, sizeof(s));
+  (*rocPulseSum)(data, nsamp/2, thr, &s);
+  if(nsamp & 1)
+    {
+      x = rocPulseSample(data, nsamp - 1);
+      s.flags |= LSWAP(data[nsamp/2]) & 0x20000000;
+      s.sum   += x;
+      if(x > s.max)
+	s.max = x;
+      s.over  += (x > thr);
+    }
+
+  if(s.over == 0)
+    return 0;
+
+  for(isamp = 0; (isamp < nsamp) && ((peak < 0) || (cross < 0)); isamp++)
+    {
+      x = rocPulseSample(data, isamp);
+      if((cross < 0) && (x > thr))
+	cross = isamp;
+      if((peak < 0) && (x == s.max))
+	peak = isamp;
+    }
+
+  integral = ((long long)4*s.sum - (long long)ped4*nsamp)/4;
+  if(integral < 0)
+    integral = 0;
+  if(integral > 0x3fffffff)
+    integral = 0x3fffffff;
+  height = s.max - ped;
+
+  out[0] = LSWAP(0xD0000000 | (ch << 23) | ((s.max >= 4095) << 22) |
+		 ((s.flags != 0) << 21) | (ped4 & 0x3fff));
+  out[1] = LSWAP((unsigned int)integral);
+  out[2] = LSWAP(((peak & 0xfff) << 16) | (height & 0x1fff));
+  out[3] = LSWAP(((cross & 0xfff) << 16) | (s.over & 0xfff));
+
+  return PULSE_WORDS;
+}
+
+#define PULSE_COPY(__w) { if(n >= max) return ERROR; out[n++] = (__w); }
+
+/* Reduced blocks of the module data in (nin words) into out, at most max
+   words.  Returns the words written, ERROR if they do not fit. */
+static int
+rocPulseReduce(unsigned int *in, int nin, unsigned int *out, int max)
+{
+  int iw = 0, n = 0, blk = 0, type = 15, nsamp, nwin;
+  unsigned int w;
+
+  while(iw < nin)
+    {
+      w = LSWAP(in[iw]);
+      if((w & 0x80000000) == 0)
+	{
+	  /* Continuation of the header words: kept */
+	  if((type == 0) || (type == 2) || (type == 3))
+	    PULSE_COPY(in[iw]);
+	  iw++;
+	  continue;
+	}
+
+      type = (w >> 27) & 0xf;
+      switch(type)
+	{
+	case 0:  /* Block header */
+	  blk = n;
+	  PULSE_COPY(in[iw]);
+	  iw++;
+	  break;
+
+	case 1:  /* Block trailer, with the words of the reduced block */
+	  w = (w & 0xffc00000) | ((n - blk + 1) & 0x3fffff);
+	  PULSE_COPY(LSWAP(w));
+	  if((n - blk) & 1)
+	    PULSE_COPY(LSWAP(0xF8000000 | (w & 0x07c00000)));
+	  iw++;
+	  break;
+
+	case 2:  /* Event header */
+	case 3:  /* Trigger time */
+	  PULSE_COPY(in[iw]);
+	  iw++;
+	  break;
+
+	case 4:  /* Window raw data */
+	  nsamp = w & 0xfff;
+	  nwin  = (nsamp + 1)/2;
+	  if(iw + 1 + nwin > nin)  /* Cut transfer */
+	    {
+	      nwin  = nin - iw - 1;
+	      nsamp = 2*nwin;
+	    }
+	  if(n + PULSE_WORDS > max)
+	    return ERROR;
+	  n  += rocPulseChannel(&in[iw + 1], (w >> 23) & 0xf, nsamp, &out[n]);
+	  iw += 1 + nwin;
+	  break;
+
+	default: /* Pulse parameters, fillers: left out */
+	  iw++;
+	  break;
+	}
+    }
+
+  return n;
+}
+
+static void
+rocPulseConfig()
+{
+  int simd;
+
+  rocPulseMode = rocConfigInt("ROC_FADC_PULSE", FADC_PULSE);
+  rocPulseNped = rocConfigInt("ROC_FADC_PULSE_NPED", FADC_PULSE_NPED);
+  rocPulseTet  = rocConfigInt("ROC_FADC_PULSE_TET", FADC_PULSE_TET);
+  simd         = rocConfigInt("ROC_FADC_PULSE_SIMD", -1);
+  rocPulsePrescale = rocConfigInt("ROC_FADC_RAW_PRESCALE", FADC_RAW_PRESCALE);
+  rocPulseRawType  = rocConfigInt("ROC_FADC_RAW_TYPE", FADC_RAW_TYPE);
+
+  /* The blocks not kept raw are reduced in bank 3 */
+  if(((rocPulsePrescale > 0) || (rocPulseRawType > 0)) && (rocPulseMode != 2))
+    {
+      printf("rocPulse: ROC_FADC_PULSE %d -> 2 for ROC_FADC_RAW_PRESCALE/TYPE\n",
+	     rocPulseMode);
+      rocPulseMode = 2;
+    }
+
+  rocPulseSum  = rocPulseSumScalar;
+  rocPulseSimd = "scalar";
+#ifdef PULSE_X86
+  __builtin_cpu_init();
+  if((simd != 0) && (simd != 1) && __builtin_cpu_supports("avx2"))
+    {
+      rocPulseSum  = rocPulseSumAvx2;
+      rocPulseSimd = "AVX2";
+    }
+  else if((simd != 0) && __builtin_cpu_supports("sse2"))
+    {
+      rocPulseSum  = rocPulseSumSse2;
+      rocPulseSimd = "SSE2";
+    }
+#endif
+
+  if(rocPulseMode)
+    printf("rocPulse: Mode %d, pedestal %d samples, threshold %d, %s\n",
+	   rocPulseMode, rocPulseNped, rocPulseTet, rocPulseSimd);
+  if((rocPulsePrescale > 0) || (rocPulseRawType > 0))
+    printf("rocPulse: Raw data kept for 1 in %d blocks and for event type %d\n",
+	   rocPulsePrescale, rocPulseRawType);
+}
+
+static void
+rocPulseClear()
+{
+  rocPulseNrange = 0;
+  rocPulseKeep = 0;
+  rocPulseSeq = 0;
+  memset(rocPulseRaw, 0, sizeof(rocPulseRaw));
+  rocPulseBlocks = rocPulseFull = 0;
+  rocPulseWordsIn = rocPulseWordsOut = rocPulseNs = 0;
+}
+
+/* Called with the TI trigger bank of the block (nwords at tibank).
+   Returns 1 if the block keeps its raw data. */
+static int
+rocPulseRawBlock(unsigned int *tibank, int nwords)
+{
+  int iw;
+  unsigned int seg;
+
+  rocPulseKeep = 0;
+  if((rocPulsePrescale <= 0) && (rocPulseRawType <= 0))
+    return 0;
+
+  if((rocPulsePrescale > 0) && ((rocPulseSeq++ % rocPulsePrescale) == 0))
+    rocPulseKeep = 1;
+  else if(rocPulseRawType > 0)
+    {
+      /* Segment of each event: type<<24 | data type<<16 | length */
+      for(iw = 2; iw < nwords; iw += 1 + (seg & 0xffff))
+	{
+	  seg = LSWAP(tibank[iw]);
+	  if((seg >> 24) == rocPulseRawType)
+	    {
+	      rocPulseKeep = 2;
+	      break;
+	    }
+	}
+    }
+
+  rocPulseRaw[rocPulseKeep]++;
+
+  return rocPulseKeep ? 1 : 0;
+}
+
+/* Module data read into the event buffer for this block */
+static inline void
+rocPulseAdd(unsigned int *data, int nwords)
+{
+  if((rocPulseMode == 0) || (nwords <= 0) || (rocPulseNrange >= PULSE_MAX_RANGES))
+    return;
+
+  rocPulseRange[rocPulseNrange]      = data;
+  rocPulseRangeWords[rocPulseNrange] = nwords;
+  rocPulseNrange++;
+}
+
+/* Called after BANKCLOSE of bank 3, which starts at bank.  Writes the
+   reduced blocks of the data added since the last call, leaving reserve
+   words free in the event buffer.  The blocks are written back to back,
+   without the word counts or pad words of the raw bank. */
+static void
+rocPulseBank(unsigned int *bank, int level, int reserve)
+{
+  unsigned int *start = dma_dabufp;
+  unsigned long long t0;
+  int ir, n, nin = 0;
+
+  if((rocPulseMode == 0) || (rocPulseNrange == 0))
+    return;
+
+  if(rocPulseKeep)
+    {
+      rocPulseNrange = 0;
+      return;
+    }
+
+  t0 = rocTimeNs();
+
+  BANKOPEN((rocPulseMode == 2) ? 3 : PULSE_BANK, BT_UI4, level);
+  *dma_dabufp++ = LSWAP((rocPulseMode == 2) ? PULSE_MARKER3 : PULSE_MARKER);
+  for(ir = 0; ir < rocPulseNrange; ir++)
+    {
+      n = rocPulseReduce(rocPulseRange[ir], rocPulseRangeWords[ir], dma_dabufp,
+			 rocEventWordsLeft() - reserve);
+      if(n < 0)
+	{
+	  /* Keep the raw data */
+	  dma_dabufp = start;
+	  rocPulseFull++;
+	  rocPulseNrange = 0;
+	  return;
+	}
+      dma_dabufp += n;
+      nin += rocPulseRangeWords[ir];
+    }
+  BANKCLOSE;
+
+  n = dma_dabufp - start;
+  if(rocPulseMode == 2)
+    {
+      memmove(bank, start, n*sizeof(unsigned int));
+      dma_dabufp = bank + n;
+    }
+
+  rocPulseBlocks++;
+  rocPulseWordsIn  += nin;
+  rocPulseWordsOut += n;
+  rocPulseNs       += rocTimeNs() - t0;
+  rocPulseNrange = 0;
+}
+
+static void
+rocPulseReport()
+{
+  if(rocPulseMode == 0)
+    return;
+
+  printf("FADC pulse reduction (ROC_FADC_PULSE %d, %s):\n", rocPulseMode, rocPulseSimd);
+  printf("  %u blocks, %llu raw words to %llu words (%.1f:1), %.2f us/block, %.1f MB/s\n",
+	 rocPulseBlocks, rocPulseWordsIn, rocPulseWordsOut,
+	 rocPulseWordsOut ? (double)rocPulseWordsIn/rocPulseWordsOut : 0.,
+	 rocPulseBlocks ? (rocPulseNs/1000.)/rocPulseBlocks : 0.,
+	 rocPulseNs ? (rocPulseWordsIn*4*1000.)/rocPulseNs : 0.);
+  if(rocPulseFull)
+    printf("  %u blocks kept raw: no room in the event buffer\n", rocPulseFull);
+  if((rocPulsePrescale > 0) || (rocPulseRawType > 0))
+    printf("  %u blocks kept raw: %u by prescale (1 in %d), %u of event type %d\n",
+	   rocPulseRaw[1] + rocPulseRaw[2], rocPulseRaw[1], rocPulsePrescale,
+	   rocPulseRaw[2], rocPulseRawType);
+}
+
+#endif /* __ROCPULSE_H */
@@ -0,0 +1,321 @@
+/*************************************************************************
+ *
+ *  rocTune.h - Scan of block level, buffer level and trigger holdoff
+ *
+ *  Usage (in a TI master readout list, after including tiprimary_list.c):
+ *
+ *    #include "rocTune.h"
+ *
+ *    rocDownload(): rocTuneDownload(&blockLevel, &bufferLevel, &holdoff);
+ *                   ... use the three values for the TI setup ...
+ *                   if(rocTuneActive) tiSetTriggerSource(TI_TRIGGER_PULSER);
+ *    rocGo():       rocTuneGo();
+ *    rocTrigger():  if(rocTuneActive) rocTuneBlock();
+ *    rocEnd():      rocTuneEnd();
+ *
+ *  With "ROC_TUNE 1" in the usrConfig file each run (Download to End) is
+ *  one point of the scan, so a scan of TUNE_NPOINT points takes as many
+ *  runs.  rocTune.sh runs them one after the other.  rocTuneDownload()
+ *  takes the next point from TUNE_STATE (one line per point already run)
+ *  and returns its settings.  rocTuneGo() starts the TI random pulser at
+ *  500 kHz/2^ROC_TUNE_RATE and stops the run after ROC_TUNE_EVENTS
+ *  events with the TI block limit.  End the run once the TI has stopped.
+ *  rocTuneEnd() appends the accepted rate, the tiLive() value and the
+ *  readout errors of the run to TUNE_STATE.  Ring full (the output ring
+ *  held the readout back) is not counted as an error.
+ *
+ *  TUNE_STATE starts with a line naming the scan:
+ *
+ *    # rocTune <rol->name> events <ROC_TUNE_EVENTS> rate <ROC_TUNE_RATE> points <TUNE_NPOINT>
+ *
+ *  followed by a comment line with the column names and one line per
+ *  point run:
+ *
+ *    <blocklevel> <bufferlevel> <holdoff> <events> <rate (Hz)> <live> <errors>
+ *
+ *  The file is only used if the first line matches the list and the
+ *  settings of this run, each point line has the settings of its place
+ *  in the scan, and it was written less than ROC_TUNE_MAXAGE hours ago
+ *  (TUNE_MAXAGE).  Otherwise the run is not a scan point (rocTuneActive
+ *  is 0) and an error names the reason.  Remove TUNE_STATE to start a
+ *  new scan.
+ *
+ *  After the last point the best stable point (every event read out, no
+ *  readout errors, highest accepted rate) is written to TUNE_RESULT as
+ *  usrConfig lines (ROC_BLOCKLEVEL, ROC_BUFFERLEVEL, ROC_HOLDOFF).
+ *
+ *************************************************************************/
+
+#ifndef __ROCTUNE_H
+#define __ROCTUNE_H
+
+#include <time.h>
+#include <sys/stat.h>
+
+#ifndef TUNE_STATE
+#define TUNE_STATE  "/tmp/rocTune.state"
+#endif
+#ifndef TUNE_RESULT
+#define TUNE_RESULT "/tmp/rocTune.result"
+#endif
+#define TUNE_EVENTS 100000  /* Default events per point */
+#define TUNE_RATE   3       /* Default random pulser setting (~62 kHz) */
+#define TUNE_MAXAGE 24      /* Default age limit of TUNE_STATE (hours) */
+
+/* Scan points: every combination of these */
+static const int rocTuneBlockLevel[]  = { 1, 2, 4, 8 };
+static const int rocTuneBufferLevel[] = { 1, 2, 4, 8 };
+static const int rocTuneHoldoff[]     = { 10, 15, 31 };  /* x 480 ns */
+#define TUNE_NBL  (sizeof(rocTuneBlockLevel)/sizeof(int))
+#define TUNE_NBUF (sizeof(rocTuneBufferLevel)/sizeof(int))
+#define TUNE_NHO  (sizeof(rocTuneHoldoff)/sizeof(int))
+#define TUNE_NPOINT (int)(TUNE_NBL*TUNE_NBUF*TUNE_NHO)
+
+typedef struct
+{
+  int          blocklevel;
+  int          bufferlevel;
+  int          holdoff;
+  unsigned int events;    /* Events read out */
+  double       rate;      /* Accepted rate (Hz) */
+  int          live;      /* tiLive() at End */
+  unsigned int errors;    /* Readout errors */
+} rocTunePoint;
+
+int rocTuneActive=0;
+static rocTunePoint rocTuneCur;
+static int rocTuneIndex=0;
+static unsigned int rocTuneEvents=TUNE_EVENTS;
+static int rocTuneRate=TUNE_RATE;
+static int rocTuneMaxAge=TUNE_MAXAGE;
+static unsigned long long rocTuneStart=0, rocTuneLast=0;
+
+/* Settings of point ipt of the scan */
+static void
+rocTunePointSet(int ipt, rocTunePoint *pt)
+{
+  memset(pt, 0, sizeof(*pt));
+  pt->holdoff     = rocTuneHoldoff[ipt % TUNE_NHO];
+  ipt /= TUNE_NHO;
+  pt->bufferlevel = rocTuneBufferLevel[ipt % TUNE_NBUF];
+  ipt /= TUNE_NBUF;
+  pt->blocklevel  = rocTuneBlockLevel[ipt];
+}
+
+/* First line of TUNE_STATE, naming the scan */
+static void
+rocTuneHeader(char *line, int size)
+{
+  snprintf(line, size, "# rocTune %s events %u rate %d points %d\n",
+	   rol->name ? rol->name : "?", rocTuneEvents, rocTuneRate, TUNE_NPOINT);
+}
+
+/* Read the points already run.  Returns how many there are, or ERROR
+   (logged) if TUNE_STATE is not from this scan or is too old. */
+static int
+rocTuneRead(rocTunePoint *pts, int npts)
+{
+  FILE *f;
+  struct stat st;
+  char line[256], header[256];
+  rocTunePoint expect;
+  int n = 0, nline = 0;
+
+  if((f = fopen(TUNE_STATE, "r")) == NULL)
+    return 0;
+
+  if((fstat(fileno(f), &st) == 0) && (rocTuneMaxAge > 0) &&
+     (time(NULL) - st.st_mtime > rocTuneMaxAge*3600L))
+    {
+      daLogMsg("ERROR","rocTune: %s is older than %d hours.  Remove it to start a new scan",
+	       TUNE_STATE, rocTuneMaxAge);
+      fclose(f);
+      return ERROR;
+    }
+
+  rocTuneHeader(header, sizeof(header));
+  while(fgets(line, sizeof(line), f) != NULL)
+    {
+      nline++;
+      if(nline == 1)
+	{
+	  if(strcmp(line, header) != 0)
+	    {
+	      daLogMsg("ERROR","rocTune: %s is not from this scan (%s).  Remove it to start a new scan",
+		       TUNE_STATE, rol->name ? rol->name : "?");
+	      fclose(f);
+	      return ERROR;
+	    }
+	  continue;
+	}
+      if(line[0] == '#')
+	continue;
+      if(n >= npts)
+	break;
+      rocTunePointSet(n, &expect);
+      if((sscanf(line, "%d %d %d %u %lf %d %u",
+		 &pts[n].blocklevel, &pts[n].bufferlevel, &pts[n].holdoff,
+		 &pts[n].events, &pts[n].rate, &pts[n].live, &pts[n].errors) != 7) ||
+	 (pts[n].blocklevel != expect.blocklevel) ||
+	 (pts[n].bufferlevel != expect.bufferlevel) ||
+	 (pts[n].holdoff != expect.holdoff))
+	{
+	  daLogMsg("ERROR","rocTune: %s line %d is not point %d of the scan.  Remove it to start a new scan",
+		   TUNE_STATE, nline, n + 1);
+	  fclose(f);
+	  return ERROR;
+	}
+      n++;
+    }
+  fclose(f);
+
+  return n;
+}
+
+/* Write the best stable point to TUNE_RESULT */
+static void
+rocTuneResult(rocTunePoint *pts, int npts)
+{
+  FILE *f;
+  int ipt, best = -1;
+
+  for(ipt = 0; ipt < npts; ipt++)
+    {
+      if((pts[ipt].errors != 0) || (pts[ipt].events < rocTuneEvents))
+	continue;
+      if((best < 0) || (pts[ipt].rate > pts[best].rate) ||
+	 ((pts[ipt].rate == pts[best].rate) && (pts[ipt].live > pts[best].live)))
+	best = ipt;
+    }
+
+  if(best < 0)
+    {
+      daLogMsg("ERROR","rocTune: No stable point in %d", npts);
+      return;
+    }
+
+  if((f = fopen(TUNE_RESULT, "w")) == NULL)
+    {
+      daLogMsg("ERROR","rocTune: Unable to write %s", TUNE_RESULT);
+      return;
+    }
+  fprintf(f, "# rocTune: best of %d points: %.0f Hz accepted, live %d\n",
+	  npts, pts[best].rate, pts[best].live);
+  fprintf(f, "ROC_BLOCKLEVEL  %d\n", pts[best].blocklevel);
+  fprintf(f, "ROC_BUFFERLEVEL %d\n", pts[best].bufferlevel);
+  fprintf(f, "ROC_HOLDOFF     %d\n", pts[best].holdoff);
+  fclose(f);
+
+  daLogMsg("INFO","rocTune: Block level %d, buffer level %d, holdoff %d (%.0f Hz).  Written to %s",
+	   pts[best].blocklevel, pts[best].bufferlevel, pts[best].holdoff,
+	   pts[best].rate, TUNE_RESULT);
+}
+
+/* Set the three values for this run.  They are left alone unless
+   ROC_TUNE is set and the scan is not finished. */
+static void
+rocTuneDownload(int *blocklevel, int *bufferlevel, int *holdoff)
+{
+  rocTunePoint pts[TUNE_NPOINT];
+
+  rocTuneActive = rocConfigInt("ROC_TUNE", 0);
+  if(!rocTuneActive)
+    return;
+
+  rocTuneEvents = rocConfigInt("ROC_TUNE_EVENTS", TUNE_EVENTS);
+  rocTuneRate   = rocConfigInt("ROC_TUNE_RATE", TUNE_RATE);
+  rocTuneMaxAge = rocConfigInt("ROC_TUNE_MAXAGE", TUNE_MAXAGE);
+
+  rocTuneIndex = rocTuneRead(pts, TUNE_NPOINT);
+  if(rocTuneIndex < 0)
+    {
+      rocTuneActive = 0;
+      return;
+    }
+  if(rocTuneIndex >= TUNE_NPOINT)
+    {
+      daLogMsg("INFO","rocTune: Scan finished, see %s.  Remove %s to start again",
+	       TUNE_RESULT, TUNE_STATE);
+      rocTuneActive = 0;
+      return;
+    }
+
+  rocTunePointSet(rocTuneIndex, &rocTuneCur);
+
+  *blocklevel  = rocTuneCur.blocklevel;
+  *bufferlevel = rocTuneCur.bufferlevel;
+  *holdoff     = rocTuneCur.holdoff;
+
+  daLogMsg("INFO","rocTune: Point %d of %d: block level %d, buffer level %d, holdoff %d",
+	   rocTuneIndex + 1, TUNE_NPOINT, *blocklevel, *bufferlevel, *holdoff);
+}
+
+static void
+rocTuneGo()
+{
+  if(!rocTuneActive)
+    return;
+
+  rocTuneStart = rocTuneLast = rocTimeNs();
+  tiSetBlockLimit((rocTuneEvents + rocTuneCur.blocklevel - 1) /
+		  rocTuneCur.blocklevel);
+  tiSetRandomTrigger(1, rocTuneRate);
+}
+
+/* Time of the last block, for the accepted rate */
+static inline void
+rocTuneBlock()
+{
+  rocTuneLast = rocTimeNs();
+}
+
+static void
+rocTuneEnd()
+{
+  rocTunePoint pts[TUNE_NPOINT];
+  FILE *f;
+  char line[256];
+  int iclass, npts;
+
+  if(!rocTuneActive)
+    return;
+
+  tiDisableRandomTrigger();
+
+  rocTuneCur.events = tiGetIntCount() * rocTuneCur.blocklevel;
+  if(rocTuneLast > rocTuneStart)
+    rocTuneCur.rate = rocTuneCur.events * 1e9 / (rocTuneLast - rocTuneStart);
+  rocTuneCur.live = tiLive(0);
+  /* Ring full is back-pressure (the readout waited), not a data error */
+  for(iclass = 0; iclass < NROCERR; iclass++)
+    if(iclass != ROCERR_RING_FULL)
+      rocTuneCur.errors += rocErrCount[iclass];
+
+  if((f = fopen(TUNE_STATE, (rocTuneIndex == 0) ? "w" : "a")) == NULL)
+    {
+      daLogMsg("ERROR","rocTune: Unable to write %s", TUNE_STATE);
+      return;
+    }
+  if(rocTuneIndex == 0)
+    {
+      rocTuneHeader(line, sizeof(line));
+      fputs(line, f);
+      fprintf(f, "# blocklevel bufferlevel holdoff events rate(Hz) live errors\n");
+    }
+  fprintf(f, "%d %d %d %u %.1f %d %u\n",
+	  rocTuneCur.blocklevel, rocTuneCur.bufferlevel, rocTuneCur.holdoff,
+	  rocTuneCur.events, rocTuneCur.rate, rocTuneCur.live, rocTuneCur.errors);
+  fclose(f);
+
+  printf("rocTune: %u events, %.0f Hz, live %d, %u errors\n",
+	 rocTuneCur.events, rocTuneCur.rate, rocTuneCur.live, rocTuneCur.errors);
+
+  if(rocTuneIndex + 1 == TUNE_NPOINT)
+    {
+      npts = rocTuneRead(pts, TUNE_NPOINT);
+      if(npts > 0)
+	rocTuneResult(pts, npts);
+    }
+}
+
+#endif /* __ROCTUNE_H */
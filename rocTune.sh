@@ -0,0 +1,89 @@
+#!/bin/sh
+#
+# File:
+#    rocTune.sh
+#
+# Description:
+#    Runs the block level / buffer level / holdoff scan of rocTune.h,
+#    one run per point, until every point is in the state file.
+#
+#      rocTune.sh [-r] [-s state] [-o result] [-m runs] command [args...]
+#
+#    command runs one run (Download, Prestart, Go, End) of a list with
+#    ROC_TUNE 1 in its usrConfig file, e.g. a run control script on a
+#    crate, or the emulator:
+#
+#      rocTune.sh -r emu/rocDriver -n 100000 -c tune.cfg ./vtpCompton_list.so
+#
+#      -r         Remove the state file first (start a new scan)
+#      -s state   State file, TUNE_STATE of the list  (/tmp/rocTune.state)
+#      -o result  Result file, TUNE_RESULT of the list (/tmp/rocTune.result)
+#      -m runs    Give up after this many runs                       (100)
+#
+#    The scan stops with an error if a run adds no point to the state
+#    file: the run failed, or the list did not take the state file (from
+#    another list or settings, or too old; see rocTune.h and the list's
+#    messages).  At the end the result file (TUNE_RESULT) is printed.
+#
+
+STATE=/tmp/rocTune.state
+RESULT=/tmp/rocTune.result
+MAXRUNS=100
+RESTART=0
+
+usage()
+{
+    echo "Usage: $0 [-r] [-s state] [-o result] [-m runs] command [args...]" >&2
+    exit 1
+}
+
+while getopts "rs:o:m:" opt; do
+    case $opt in
+	r) RESTART=1 ;;
+	s) STATE=$OPTARG ;;
+	o) RESULT=$OPTARG ;;
+	m) MAXRUNS=$OPTARG ;;
+	*) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] || usage
+
+# Points run so far, and the number in the scan (from the first line)
+npoints()
+{
+    if [ -f "$STATE" ]; then grep -vc '^#' "$STATE"; else echo 0; fi
+}
+ntotal()
+{
+    [ -f "$STATE" ] && sed -n '1s/.* points \([0-9]*\)$/\1/p' "$STATE"
+}
+
+if [ $RESTART -eq 1 ]; then
+    rm -f "$STATE" "$RESULT"
+fi
+
+nrun=0
+while :; do
+    have=$(npoints)
+    total=$(ntotal)
+    if [ -n "$total" ] && [ "$have" -ge "$total" ]; then
+	break
+    fi
+    if [ $nrun -ge "$MAXRUNS" ]; then
+	echo "$0: ERROR: $have points after $nrun runs" >&2
+	exit 1
+    fi
+
+    echo "$0: point $((have + 1))${total:+ of $total}"
+    "$@" || { echo "$0: ERROR: run failed (exit status $?)" >&2; exit 1; }
+    nrun=$((nrun + 1))
+
+    if [ "$(npoints)" -le "$have" ]; then
+	echo "$0: ERROR: the run added no point to $STATE" >&2
+	exit 1
+    fi
+done
+
+echo "$0: scan of $total points finished"
+cat "$RESULT" || exit 1
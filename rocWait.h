@@ -0,0 +1,158 @@
+/*************************************************************************
+ *
+ *  rocWait.h - Wait for modules to have a block ready for readout
+ *
+ *  Usage (in a readout list):
+ *
+ *    #include "rocWait.h"
+ *
+ *    static rocWaitStat faWait = {"FADC250"};
+ *
+ *    rocGo():       rocWaitClear(&faWait);
+ *    rocTrigger():  datascan = rocWaitReady(&faWait, faGBready, scanmask,
+ *                                           FADC_READY_TIMEOUT);
+ *    rocEnd():      rocWaitReport(&faWait);
+ *    End drain:     rocWaitStuck(&faWait);   (from rocEndStuckHook)
+ *
+ *  rocWaitReady() calls ready() until every bit of mask is set, or until
+ *  timeout_us microseconds have passed.  The first read is made at once;
+ *  after that the time between reads starts at WAIT_BACKOFF_MIN ns and
+ *  doubles up to WAIT_BACKOFF_MAX ns, so a module that is late does not
+ *  fill the VME bus with register reads.  The last value of ready() is
+ *  returned.  The bits of mask still not set when a wait times out (the
+ *  slots, for faGBready and vetrocGBready) are kept until a wait ends
+ *  ready, for rocWaitStuck() to name them.
+ *
+ *************************************************************************/
+
+#ifndef __ROCWAIT_H
+#define __ROCWAIT_H
+
+#include <time.h>
+
+#ifndef WAIT_BACKOFF_MIN
+#define WAIT_BACKOFF_MIN   200  /* ns */
+#endif
+#ifndef WAIT_BACKOFF_MAX
+#define WAIT_BACKOFF_MAX 10000  /* ns */
+#endif
+
+typedef struct
+{
+  char               *name;
+  unsigned int        calls;     /* Waits */
+  unsigned int        waited;    /* Waits where the first read was not ready */
+  unsigned int        timeouts;  /* Waits that reached the deadline */
+  unsigned long long  polls;     /* Reads of the ready register */
+  unsigned long long  ns;        /* Total time waited */
+  unsigned long long  maxns;     /* Longest wait */
+  unsigned int        missing;   /* Mask bits not ready at the last wait, if
+				    it timed out */
+} rocWaitStat;
+
+static inline unsigned long long
+rocWaitNow()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int
+rocWaitReady(rocWaitStat *st, unsigned int (*ready)(), unsigned int mask,
+	     int timeout_us)
+{
+  unsigned int rval;
+  unsigned long long start, now, next, deadline, backoff = WAIT_BACKOFF_MIN;
+
+  st->calls++;
+  st->polls++;
+
+  rval = (*ready)();
+  if((rval & mask) == mask)
+    {
+      st->missing = 0;
+      return rval;
+    }
+
+  st->waited++;
+  start = now = rocWaitNow();
+  deadline = start + (unsigned long long)timeout_us*1000ULL;
+
+  while(1)
+    {
+      next = now + backoff;
+      if(next > deadline)
+	next = deadline;
+      while((now = rocWaitNow()) < next)
+	;
+
+      st->polls++;
+      rval = (*ready)();
+      if((rval & mask) == mask)
+	{
+	  st->missing = 0;
+	  break;
+	}
+
+      if(now >= deadline)
+	{
+	  st->timeouts++;
+	  st->missing = mask & ~rval;
+	  break;
+	}
+
+      backoff <<= 1;
+      if(backoff > WAIT_BACKOFF_MAX)
+	backoff = WAIT_BACKOFF_MAX;
+    }
+
+  now -= start;
+  st->ns += now;
+  if(now > st->maxns)
+    st->maxns = now;
+
+  return rval;
+}
+
+static void
+rocWaitClear(rocWaitStat *st)
+{
+  char *name = st->name;
+
+  memset(st, 0, sizeof(rocWaitStat));
+  st->name = name;
+}
+
+static void
+rocWaitReport(rocWaitStat *st)
+{
+  printf("%s ready wait: %u blocks, %u waited (mean %.1f us, max %.1f us), %u timeouts, %.2f reads/block\n",
+	 st->name, st->calls, st->waited,
+	 st->waited ? (st->ns/1000.)/st->waited : 0.,
+	 st->maxns/1000.,
+	 st->timeouts,
+	 st->calls ? (double)st->polls/st->calls : 0.);
+}
+
+/* Name the slots that were not ready when the last wait timed out */
+static void
+rocWaitStuck(rocWaitStat *st)
+{
+  char slots[100];
+  int islot, n = 0;
+
+  if(st->missing == 0)
+    return;
+
+  slots[0] = '\0';
+  for(islot = 0; islot < 32; islot++)
+    if(st->missing & (1U<<islot))
+      n += snprintf(slots + n, sizeof(slots) - n, " %d", islot);
+
+  daLogMsg("WARN","%s not ready in slot(s)%s (%u timeouts this run)",
+	   st->name, slots, st->timeouts);
+}
+
+#endif /* __ROCWAIT_H */
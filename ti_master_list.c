@@ -28,6 +28,13 @@
 #define BLOCKLEVEL 1
 #define BUFFERLEVEL 10
 
+/* Block level changed by the TI at a sync event (ROC_BLOCK_ADAPT) */
+static void
+blockLevelChange(int level)
+{
+  /* TI only: no modules to set */
+}
+
 /****************************************
  *  DOWNLOAD
  ****************************************/
@@ -100,6 +107,14 @@ rocDownload()
 
   tiStatus(0);
 
+  /* Block level may follow the trigger rate (ROC_BLOCK_ADAPT) */
+  rocAdaptHook = blockLevelChange;
+
+  /* Largest block this configuration can produce, to size the event buffers */
+  rocSetEventLength(4*((8 + 5*rocBlockLevelMax(blockLevel)) /* TI trigger bank */
+		       + 6                     /* Bank 5 */
+		       + 6));                  /* Bank 7 */
+
   printf("rocDownload: User Download Executed\n");
 
 }
@@ -187,8 +202,8 @@ rocTrigger(int arg)
   unsigned int val;
   unsigned int *start;
 
-  /* Set TI output 1 high for diagnostics */
-  tiSetOutputPort(1,0,0,0);
+  /* Set TI output 1 high for diagnostics, if enabled */
+  ROC_DIAG_START;
 
   /* Readout the trigger block from the TI 
      Trigger Block MUST be reaodut first */
@@ -196,7 +211,7 @@ rocTrigger(int arg)
 
   if(dCnt<=0)
     {
-      printf("No TI Trigger data or error.  dCnt = %d\n",dCnt);
+      rocErrLog(ROCERR_TI_READ, tiGetIntCount(), dCnt, 0, 0);
     }
   else
     { /* TI Data is already in a bank structure.  Bump the pointer */
@@ -211,8 +226,8 @@ rocTrigger(int arg)
   *dma_dabufp++ = 0xcebaf222;
   BANKCLOSE;
 
-  /* Set TI output 0 low */
-  tiSetOutputPort(0,0,0,0);
+  /* Set TI outputs low */
+  ROC_DIAG_STOP;
 
 }
 
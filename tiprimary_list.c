@@ -29,6 +29,13 @@
 #endif
 
 #include <string.h>
+#include <errno.h>
+#ifdef LINUX
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 #include <rol.h>
 #include "jvme.h"
 #include "tiLib.h"
@@ -58,47 +65,790 @@ extern FUNCPTR tsLiveFunc;
 
 extern int tiDoAck;
 extern unsigned int tiIntCount;
+
+/* Readout error log.
+   Nothing in the readout thread may wait on a terminal or on the ROC's
+   message connection.  Errors are counted per class and queued in a
+   single-producer/single-consumer ring (readout thread -> rocErrLogThread),
+   which passes them to daLogMsg.  Each class queues at most ERRLOG_RATE
+   messages per second; the rest are only counted.  (vxWorks: logMsg()
+   already queues to a separate task.) */
+enum rocErrClass
+  {
+    ROCERR_TI_READ,        /* No TI trigger data, or error */
+    ROCERR_DATASCAN,       /* Not all modules had a block ready */
+    ROCERR_BLOCK,          /* Error in a module block transfer */
+    ROCERR_VETROC_MISSED,  /* VETROC block not ready */
+    ROCERR_OVERFLOW,       /* Event larger than its buffer */
+    ROCERR_NO_BUFFER,      /* No free event buffer for a trigger */
+    ROCERR_SCALER,         /* Error in a scaler FIFO transfer */
+    ROCERR_NO_SPACE,       /* Module block dropped, no room in the event buffer */
+    ROCERR_RING_FULL,      /* Output ring full, readout held */
+    NROCERR
+  };
+static char *rocErrName[NROCERR] =
+  { "TI read", "Datascan", "Block error", "Missed VETROC",
+    "Buffer overflow", "No buffer", "Scaler transfer", "Block dropped",
+    "Output ring full" };
+static char *rocErrFormat[NROCERR] =
+  {
+    "Event %u: No TI Trigger data or error.  dCnt = %d",
+    "Event %u: Datascan != Scanmask  (0x%08x != 0x%08x)",
+    "Event %u: Slot %d: Error in block transfer, nwords = 0x%x",
+    "Event %u: Missed VETROC event data: gbready=0x%08X, vetrocSlotMask=0x%08X",
+    "Event %u: Event length > Buffer size (%d > %d)",
+    "Event %u: No DMA Buffer Available. Events could be out of sync!",
+    "Event %u: Scaler FIFO entry %d: Error in block transfer, nbytes = %d",
+    "Event %u: Slot %d: Only %d words left in the event buffer, %d needed.  Block dropped",
+    "Event %u: Output ring full for %d events, readout held %d us, %d events dropped"
+  };
+
+/* TI front panel outputs as scope markers for the readout.
+     rocDiagMode 0: off
+                 1: output 1 high for the whole of rocTrigger()
+                 2: as 1, and output 2, 3 or 4 high for the readout phase
+                    started with ROC_DIAG_PHASE(2..4)
+   Set with ROC_DIAG in the usrConfig file.  On Linux it can also be
+   changed during a run by writing the digit to DIAG_FILE, which is
+   removed at Download so it does not outlive the ROC that used it.
+   When off, a block costs one test of a variable and no VME writes. */
+#ifndef DIAG_MODE
+#define DIAG_MODE 0
+#endif
+#define DIAG_FILE "/dev/shm/rocDiag"
+volatile int rocDiagMode=DIAG_MODE;
+static int rocDiagBlock=0;   /* rocDiagMode latched for this block */
+#define ROC_DIAG_START {					\
+    rocDiagBlock = rocDiagMode;					\
+    if(rocDiagBlock) tiSetOutputPort(1,0,0,0);			\
+  }
+#define ROC_DIAG_PHASE(__out) {						\
+    if(rocDiagBlock > 1)						\
+      tiSetOutputPort(1,(__out)==2,(__out)==3,(__out)==4);		\
+  }
+#define ROC_DIAG_STOP {						\
+    if(rocDiagBlock) tiSetOutputPort(0,0,0,0);			\
+  }
+
 #ifdef LINUX
 extern int tiNeedAck;
 
-/* Condition Variable for Readout Acknowledge */
-pthread_mutex_t ack_mutex=PTHREAD_MUTEX_INITIALIZER;
-#define ACKLOCK {				\
-    if(pthread_mutex_lock(&ack_mutex)<0)	\
-      perror("pthread_mutex_lock");		\
+/* Single-producer / single-consumer rings of filled event buffers.
+   linuxusrtrig() (ROC output thread) is the only consumer of both.
+   asyncTrigger() (TI polling thread) is the only producer of rocRing.
+   rocUserRing takes events built by one thread of the user list (e.g.
+   scalers read on their own), see rocUserEventPut().  rocFreeRing
+   takes the vmeIN buffers back the other way, from linuxusrtrig() to
+   asyncTrigger(), so that once each buffer has gone round once the
+   readout does not lock the vmeIN partition (see rocEventGet()).  The
+   hand-off needs no lock: each side owns one index and publishes it
+   with a release store. */
+#ifndef ROC_RING_SIZE
+#define ROC_RING_SIZE 256  /* Power of 2, larger than the event pool */
+#endif
+#define ROC_RING_MASK (ROC_RING_SIZE-1)
+typedef struct
+{
+  DMANODE            *node[ROC_RING_SIZE];
+  unsigned long long  time[ROC_RING_SIZE]; /* Time put (ns) */
+  int                 level[ROC_RING_SIZE]; /* Block level of the event */
+  unsigned int        head; /* Written by the producer only */
+  unsigned int        tail; /* Written by the consumer only */
+  unsigned int        next; /* Producer's next slot, published
+			       to the consumer by rocRingPublish() */
+} rocRingBuffer;
+static rocRingBuffer rocRing;
+static rocRingBuffer rocUserRing;
+static rocRingBuffer rocFreeRing;
+
+/* Set by the user list while its event thread may still put events */
+volatile int rocUserActive=0;
+
+#define RING_LOAD(__v)      __atomic_load_n(&(__v), __ATOMIC_ACQUIRE)
+#define RING_STORE(__v,__x) __atomic_store_n(&(__v), (__x), __ATOMIC_RELEASE)
+
+/* Set at End.  Tells the producer not to wait for buffers that will
+   not come back */
+volatile int ack_runend=0;
+
+static unsigned long long
+rocTimeNs()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec*1000000000ULL + ts.tv_nsec;
 }
-#define ACKUNLOCK {				\
-    if(pthread_mutex_unlock(&ack_mutex)<0)	\
-      perror("pthread_mutex_unlock");		\
+
+static int
+rocRingCount(rocRingBuffer *ring)
+{
+  return (int)(RING_LOAD(ring->head) - RING_LOAD(ring->tail));
 }
-pthread_cond_t ack_cv = PTHREAD_COND_INITIALIZER;
-#define ACKWAIT {					\
-    if(pthread_cond_wait(&ack_cv, &ack_mutex)<0)	\
-      perror("pthread_cond_wait");			\
+
+static void
+rocRingReset(rocRingBuffer *ring)
+{
+  ring->head = ring->tail = ring->next = 0;
 }
-#define ACKSIGNAL {					\
-    if(pthread_cond_signal(&ack_cv)<0)			\
-      perror("pthread_cond_signal");			\
-  }
-int ack_runend=0;
 
-#ifdef LINUX
-pthread_cond_t endrun_cv = PTHREAD_COND_INITIALIZER;
-struct timespec endrun_waittime;
-int endrun_timedwait_ret=0;
-#define ENDRUN_TIMEDWAIT(__x) {						\
-    clock_gettime(CLOCK_REALTIME, &endrun_waittime);			\
-    endrun_waittime.tv_sec += __x;					\
-    endrun_timedwait_ret = pthread_cond_timedwait(&endrun_cv, &ack_mutex, &endrun_waittime); \
-    if(endrun_timedwait_ret<0)						\
-      perror("pthread_cond_timedwait");					\
-  }
-#define ENDRUN_SIGNAL {					\
-    if(pthread_cond_signal(&endrun_cv)<0)		\
-      perror("pthread_cond_signal");			\
-  }
+static int
+rocRingPut(rocRingBuffer *ring, DMANODE *node, int level)
+{
+  unsigned int next = ring->next;
+
+  if((next - RING_LOAD(ring->tail)) >= ROC_RING_SIZE)
+    return ERROR;
+
+  ring->node[next & ROC_RING_MASK] = node;
+  ring->time[next & ROC_RING_MASK] = rocTimeNs();
+  ring->level[next & ROC_RING_MASK] = level;
+  ring->next = next + 1;
+
+  return OK;
+}
+
+/* Make every node put since the last call visible to the consumer */
+static void
+rocRingPublish(rocRingBuffer *ring)
+{
+  RING_STORE(ring->head, ring->next);
+}
+
+static DMANODE *
+rocRingGet(rocRingBuffer *ring, unsigned long long *puttime, int *level)
+{
+  unsigned int tail = ring->tail;
+  DMANODE *node;
+
+  if(tail == RING_LOAD(ring->head))
+    return NULL;
+
+  node = ring->node[tail & ROC_RING_MASK];
+  *puttime = ring->time[tail & ROC_RING_MASK];
+  *level   = ring->level[tail & ROC_RING_MASK];
+  RING_STORE(ring->tail, tail + 1);
+
+  return node;
+}
+
+/* Queue an event built outside of rocTrigger() for output.
+   node->data must hold the complete contents of the ROC bank (one
+   event, with its own trigger bank), node->length its length in words.
+   The node goes back to its partition after output.  Call from one
+   thread only. */
+int
+rocUserEventPut(DMANODE *node)
+{
+  if(rocRingPut(&rocUserRing, node, 1) != OK)
+    return ERROR;
+
+  rocRingPublish(&rocUserRing);
+
+  return OK;
+}
+
+/* Set by the user list when a thread of its own accesses the VME bus
+   during the run (e.g. scalers read on their own).  asyncTrigger() then
+   holds vmeBusLock() while it reads out, and the user thread takes the
+   same lock around its own accesses. */
+int rocReadoutLock=0;
+
+/* Return the user events the output did not take to their partition.
+   Call after the user thread has stopped, while the partitions exist. */
+static void
+rocUserRingFlush()
+{
+  DMANODE *node;
+  unsigned long long puttime;
+  int level;
+
+  while((node = rocRingGet(&rocUserRing, &puttime, &level)) != NULL)
+    dmaPFreeItem(node);
+  rocRingReset(&rocUserRing);
+}
+
+/* Return the buffers in rocFreeRing to vmeIN.  Call when neither the
+   readout nor the output runs, before vmeIN is used or freed. */
+static void
+rocFreeRingFlush()
+{
+  DMANODE *node;
+  unsigned long long puttime;
+  int level;
 
+  while((node = rocRingGet(&rocFreeRing, &puttime, &level)) != NULL)
+    dmaPFreeItem(node);
+  rocRingReset(&rocFreeRing);
+}
+
+/* Back off while waiting on the other side of the ring: spin briefly,
+   then sleep so the output thread gets the CPU */
+static void
+rocRingBackoff(int iwait)
+{
+  struct timespec ts = {0, 10000};
+
+  if(iwait < 100)
+    __asm__ __volatile__("" ::: "memory");
+  else
+    nanosleep(&ts, NULL);
+}
+
+/* Event hand-off latency (ring put to ring get), log2(ns) histogram.
+   Filled by the output thread, reported at End. */
+#define HANDOFF_NBIN 40
+static unsigned int rocHandoffHist[HANDOFF_NBIN];
+static unsigned int rocHandoffCount=0;
+static unsigned long long rocHandoffMax=0;
+
+static void
+rocHandoffFill(unsigned long long ns)
+{
+  int ibin = 0;
+
+  while((ns >> ibin) && (ibin < HANDOFF_NBIN-1))
+    ibin++;
+
+  rocHandoffHist[ibin]++;
+  rocHandoffCount++;
+  if(ns > rocHandoffMax)
+    rocHandoffMax = ns;
+}
+
+static void
+rocHandoffReport()
+{
+  int ibin, iq;
+  unsigned int sum = 0;
+  const double quant[4] = {0.5, 0.99, 0.999, 1.0};
+  const char *qname[4] = {"p50", "p99", "p99.9", "p100"};
+
+  if(rocHandoffCount == 0)
+    return;
+
+  printf("Event hand-off latency (%d events, max %llu ns):\n",
+	 rocHandoffCount, rocHandoffMax);
+  for(iq = 0, ibin = 0; (iq < 4) && (ibin < HANDOFF_NBIN); ibin++)
+    {
+      sum += rocHandoffHist[ibin];
+      while((iq < 4) && (sum >= quant[iq]*rocHandoffCount))
+	{
+	  printf("  %-6s < %llu ns\n", qname[iq], 1ULL << ibin);
+	  iq++;
+	}
+    }
+}
+
+/* Readout (TI polling) thread and output (ROC) thread scheduling.
+   Both threads are created outside of this list, so each applies its
+   own settings the first time it runs after Prestart. */
+#ifndef READOUT_CPU
+#define READOUT_CPU  -1  /* CPU for the TI polling thread, -1 = any */
+#endif
+#ifndef READOUT_PRIO
+#define READOUT_PRIO  0  /* SCHED_FIFO priority, 0 = default scheduling */
+#endif
+#ifndef OUTPUT_CPU
+#define OUTPUT_CPU   -1  /* CPU for the ROC output thread, -1 = any */
 #endif
+#ifndef OUTPUT_PRIO
+#define OUTPUT_PRIO   0  /* SCHED_FIFO priority, 0 = default scheduling */
+#endif
+#ifndef MLOCK_MEMORY
+#define MLOCK_MEMORY  0  /* 1 = mlockall() the ROC at Download */
+#endif
+int rocReadoutCpu=READOUT_CPU, rocReadoutPrio=READOUT_PRIO;
+int rocOutputCpu=OUTPUT_CPU, rocOutputPrio=OUTPUT_PRIO;
+static volatile int rocReadoutSched=0, rocOutputSched=0; /* 1 = to be applied */
+
+static void
+rocThreadSched(char *name, int cpu, int prio)
+{
+  cpu_set_t cpuset;
+  struct sched_param param;
+  int rval;
+
+  if(cpu >= 0)
+    {
+      CPU_ZERO(&cpuset);
+      CPU_SET(cpu, &cpuset);
+      rval = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+      if(rval != 0)
+	daLogMsg("WARN","%s thread: Unable to pin to CPU %d (%s)",
+		 name, cpu, strerror(rval));
+    }
+
+  if(prio > 0)
+    {
+      memset(&param, 0, sizeof(param));
+      param.sched_priority = prio;
+      rval = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+      if(rval != 0)
+	daLogMsg("WARN","%s thread: Unable to set SCHED_FIFO priority %d (%s)",
+		 name, prio, strerror(rval));
+    }
+
+  printf("%s: %s thread: cpu = %d  SCHED_FIFO priority = %d\n",
+	 __func__, name, cpu, prio);
+}
+
+#ifndef ERRLOG_RATE
+#define ERRLOG_RATE  10   /* Messages per second per class */
+#endif
+#define ERRLOG_SIZE 256   /* Power of 2 */
+typedef struct
+{
+  int          eclass;
+  unsigned int event;
+  unsigned int arg[3];
+} rocErrEntry;
+static rocErrEntry rocErrRing[ERRLOG_SIZE];
+static unsigned int rocErrHead=0, rocErrTail=0;
+unsigned int rocErrCount[NROCERR];          /* Errors this run */
+static unsigned int rocErrSuppressed[NROCERR]; /* Counted, not logged */
+static unsigned long long rocErrWindow[NROCERR];
+static int rocErrInWindow[NROCERR];
+static pthread_t rocErrLogPth;
+static volatile int rocErrLogRun=0;
+
+/* Record an error from the readout thread.  Never blocks. */
+void
+rocErrLog(int eclass, unsigned int event, unsigned int a0, unsigned int a1,
+	  unsigned int a2)
+{
+  unsigned long long now = rocTimeNs();
+  unsigned int head = rocErrHead;
+  rocErrEntry *entry;
+
+  rocErrCount[eclass]++;
+
+  if((now - rocErrWindow[eclass]) > 1000000000ULL)
+    {
+      rocErrWindow[eclass] = now;
+      rocErrInWindow[eclass] = 0;
+    }
+
+  if((rocErrInWindow[eclass] >= ERRLOG_RATE) ||
+     ((head - RING_LOAD(rocErrTail)) >= ERRLOG_SIZE))
+    {
+      rocErrSuppressed[eclass]++;
+      return;
+    }
+  rocErrInWindow[eclass]++;
+
+  entry = &rocErrRing[head & (ERRLOG_SIZE-1)];
+  entry->eclass = eclass;
+  entry->event  = event;
+  entry->arg[0] = a0;
+  entry->arg[1] = a1;
+  entry->arg[2] = a2;
+  RING_STORE(rocErrHead, head + 1);
+}
+
+/* Output ring full episode: consecutive blocks held until the output
+   thread took an event.  Logged once, when it is over. */
+static unsigned long long rocRingFullStart=0, rocRingFullStop=0;
+static unsigned int rocRingFullEvent=0, rocRingFullHeld=0, rocRingFullDropped=0;
+
+static void
+rocRingFullDone()
+{
+  if(rocRingFullHeld == 0)
+    return;
+
+  rocErrLog(ROCERR_RING_FULL, rocRingFullEvent, rocRingFullHeld,
+	    (unsigned int)((rocRingFullStop - rocRingFullStart)/1000ULL),
+	    rocRingFullDropped);
+  rocRingFullHeld = rocRingFullDropped = 0;
+}
+
+/* Block level changes (ROC_BLOCK_ADAPT), from the readout thread to
+   rocErrLogThread, logged as INFO.  Their own ring, so they are neither
+   counted as errors nor rate limited with them.  There are a few per
+   ADAPT_PERIOD at most. */
+#define ADAPT_NOTE_SIZE 8  /* Power of 2 */
+typedef struct
+{
+  int          applied;  /* 0: requested from the TI, 1: made at a sync event */
+  unsigned int count;    /* TI block count */
+  unsigned int rate;     /* Trigger rate (Hz), when requested */
+  int          from, to; /* Block levels */
+} rocAdaptNote;
+static rocAdaptNote rocAdaptNotes[ADAPT_NOTE_SIZE];
+static unsigned int rocAdaptNoteHead=0, rocAdaptNoteTail=0;
+
+/* Queue a block level change.  Never blocks, drops it if the ring is full */
+static void
+rocAdaptNotePut(int applied, unsigned int count, unsigned int rate, int from,
+		int to)
+{
+  unsigned int head = rocAdaptNoteHead;
+  rocAdaptNote *note;
+
+  if((head - RING_LOAD(rocAdaptNoteTail)) >= ADAPT_NOTE_SIZE)
+    return;
+
+  note = &rocAdaptNotes[head & (ADAPT_NOTE_SIZE-1)];
+  note->applied = applied;
+  note->count   = count;
+  note->rate    = rate;
+  note->from    = from;
+  note->to      = to;
+  RING_STORE(rocAdaptNoteHead, head + 1);
+}
+
+static void
+rocAdaptNoteDrain()
+{
+  unsigned int tail = rocAdaptNoteTail;
+  rocAdaptNote *note;
+
+  while(tail != RING_LOAD(rocAdaptNoteHead))
+    {
+      note = &rocAdaptNotes[tail & (ADAPT_NOTE_SIZE-1)];
+      if(note->applied)
+	daLogMsg("INFO","Block %u: Block level %d -> %d",
+		 note->count, note->from, note->to);
+      else
+	daLogMsg("INFO","Block %u: Trigger rate %u Hz: block level %d -> %d at the next sync event",
+		 note->count, note->rate, note->from, note->to);
+      RING_STORE(rocAdaptNoteTail, ++tail);
+    }
+}
+
+/* Pass queued errors to daLogMsg.  Returns the number passed. */
+static int
+rocErrLogDrain()
+{
+  unsigned int tail = rocErrTail;
+  rocErrEntry *entry;
+  int n = 0;
+
+  while(tail != RING_LOAD(rocErrHead))
+    {
+      entry = &rocErrRing[tail & (ERRLOG_SIZE-1)];
+      daLogMsg("ERROR", rocErrFormat[entry->eclass], entry->event,
+	       entry->arg[0], entry->arg[1], entry->arg[2]);
+      RING_STORE(rocErrTail, ++tail);
+      n++;
+    }
+
+  return n;
+}
+
+/* Pick up a diagnostic mode written to DIAG_FILE */
+static void
+rocDiagPoll()
+{
+  char mode;
+  int fd;
+
+  fd = open(DIAG_FILE, O_RDONLY);
+  if(fd < 0)
+    return;
+
+  if((read(fd, &mode, 1) == 1) && (mode >= '0') && (mode <= '2') &&
+     (rocDiagMode != (mode - '0')))
+    {
+      rocDiagMode = mode - '0';
+      daLogMsg("INFO","Diagnostic output mode %d", rocDiagMode);
+    }
+
+  close(fd);
+}
+
+/* Also polls DIAG_FILE, every 100 ms */
+static void *
+rocErrLogThread(void *arg)
+{
+  struct timespec ts = {0, 10000000};
+  unsigned long long now, lastpoll = 0;
+
+  while(rocErrLogRun)
+    {
+      rocAdaptNoteDrain();
+      if(rocErrLogDrain() == 0)
+	nanosleep(&ts, NULL);
+
+      now = rocTimeNs();
+      if((now - lastpoll) > 100000000ULL)
+	{
+	  rocDiagPoll();
+	  lastpoll = now;
+	}
+    }
+  rocAdaptNoteDrain();
+  rocErrLogDrain();
+
+  return NULL;
+}
+
+static void
+rocErrLogStart()
+{
+  memset(rocErrCount, 0, sizeof(rocErrCount));
+  memset(rocErrSuppressed, 0, sizeof(rocErrSuppressed));
+  memset(rocErrWindow, 0, sizeof(rocErrWindow));
+  rocErrHead = rocErrTail = 0;
+  rocAdaptNoteHead = rocAdaptNoteTail = 0;
+
+  rocErrLogRun = 1;
+  if(pthread_create(&rocErrLogPth, NULL, rocErrLogThread, NULL) != 0)
+    {
+      perror("pthread_create");
+      rocErrLogRun = 0;
+    }
+}
+
+static void
+rocErrLogStop()
+{
+  int iclass;
+
+  if(rocErrLogRun)
+    {
+      rocErrLogRun = 0;
+      pthread_join(rocErrLogPth, NULL);
+    }
+
+  for(iclass = 0; iclass < NROCERR; iclass++)
+    {
+      if(rocErrCount[iclass])
+	daLogMsg("WARN","%s: %d (%d not logged)",
+		 rocErrName[iclass], rocErrCount[iclass], rocErrSuppressed[iclass]);
+    }
+}
+
+/* Blocks read out per asyncTrigger() call.
+   When the TI has more than one block buffered, asyncTrigger() reads
+   them into consecutive buffers and publishes them to the output ring
+   together, instead of returning to the polling thread for each one. */
+#ifndef BATCH_MAX
+#define BATCH_MAX     1  /* 1 = one block per call */
+#endif
+#define BATCH_LIMIT  32
+int rocBatchMax=BATCH_MAX;
+static unsigned int rocBatchHist[BATCH_LIMIT+1]; /* Calls, by blocks read */
+static unsigned int rocBatchExtra=0; /* Blocks read beyond one per call */
+
+static void
+rocBatchReport()
+{
+  int ib, nmax=0;
+  unsigned int ncall=0, nblock=0;
+
+  for(ib = 1; ib <= BATCH_LIMIT; ib++)
+    {
+      ncall  += rocBatchHist[ib];
+      nblock += ib*rocBatchHist[ib];
+      if(rocBatchHist[ib])
+	nmax = ib;
+    }
+  if(ncall == 0)
+    return;
+
+  printf("Blocks per readout call (max %d): mean %.2f\n",
+	 rocBatchMax, (double)nblock/ncall);
+  for(ib = 1; ib <= nmax; ib++)
+    printf("  %2d: %u\n", ib, rocBatchHist[ib]);
+}
+
+/* Rate-adaptive block level (TI master only).
+   With ROC_BLOCK_ADAPT 1 in the usrConfig file, and a list that has set
+   rocAdaptHook, the readout thread measures the trigger rate every
+   ADAPT_PERIOD ms.  The block level for about ADAPT_BLOCK_RATE blocks/s
+   (a power of 2, at most ROC_BLOCK_MAX) is requested from the TI with
+   tiBroadcastNextBlockLevel() once it has been the same for two periods
+   in a row.  The TI changes the level at the next sync event, which
+   comes every ADAPT_SYNC_INTERVAL blocks.  After the sync block has been
+   read out, rocAdaptHook(level) sets the modules to the new level, and
+   a bank recording the change is added to that block:
+     bank 7: 0xb0b0b0b7, TI trigger count, old level, new level
+   The list must size its event buffers for ROC_BLOCK_MAX, see
+   rocBlockLevelMax(). */
+#ifndef ADAPT_PERIOD
+#define ADAPT_PERIOD         1000  /* ms */
+#endif
+#ifndef ADAPT_BLOCK_RATE
+#define ADAPT_BLOCK_RATE     2000  /* Blocks/s */
+#endif
+#ifndef ADAPT_SYNC_INTERVAL
+#define ADAPT_SYNC_INTERVAL  1000  /* Blocks */
+#endif
+#define ADAPT_BLOCK_MAX         8
+int rocAdaptOn=0;
+int rocAdaptMax=ADAPT_BLOCK_MAX;
+void (*rocAdaptHook)(int level) = NULL;
+static unsigned long long rocAdaptTime=0;
+static unsigned int rocAdaptCount=0;
+static int rocAdaptWant=0, rocAdaptPending=0;
+
+/* Largest block level of a run, for buffer sizing in rocDownload() */
+int
+rocBlockLevelMax(int level)
+{
+  if(rocAdaptOn && (rocAdaptMax > level))
+    return rocAdaptMax;
+  return level;
+}
+
+static void
+rocAdaptStart()
+{
+  rocAdaptTime = rocTimeNs();
+  rocAdaptCount = tiGetIntCount();
+  rocAdaptWant = blockLevel;
+  rocAdaptPending = 0;
+}
+
+/* Called after rocTrigger() for every block, with rocAdaptOn set */
+static void
+rocAdaptBlock()
+{
+  unsigned long long now;
+  unsigned int count;
+  double rate;
+  int want, old;
+
+  /* The level only changes at a sync event after a request */
+  if(rocAdaptPending && tiGetSyncEventFlag())
+    {
+      old = blockLevel;
+      blockLevel = tiGetCurrentBlockLevel();
+      rocAdaptPending = 0;
+
+      if(blockLevel != old)
+	{
+	  (*rocAdaptHook)(blockLevel);
+	  rocAdaptNotePut(1, tiGetIntCount(), 0, old, blockLevel);
+
+	  BANKOPEN(7,BT_UI4,0);
+	  *dma_dabufp++ = LSWAP(0xb0b0b0b7);
+	  *dma_dabufp++ = LSWAP(tiGetIntCount());
+	  *dma_dabufp++ = LSWAP(old);
+	  *dma_dabufp++ = LSWAP(blockLevel);
+	  BANKCLOSE;
+	}
+    }
+
+  now = rocTimeNs();
+  if((now - rocAdaptTime) < ADAPT_PERIOD*1000000ULL)
+    return;
+
+  count = tiGetIntCount();
+  rate = (double)(count - rocAdaptCount) * blockLevel * 1e9 / (now - rocAdaptTime);
+  rocAdaptTime = now;
+  rocAdaptCount = count;
+
+  want = 1;
+  while((want < rocAdaptMax) && (rate > (double)want*ADAPT_BLOCK_RATE))
+    want <<= 1;
+
+  if((want != blockLevel) && (want == rocAdaptWant) && !rocAdaptPending)
+    {
+      tiBroadcastNextBlockLevel(want);
+      rocAdaptPending = 1;
+      rocAdaptNotePut(0, count, (unsigned int)rate, blockLevel, want);
+    }
+  rocAdaptWant = want;
+}
+
+/* End of run drain.
+   The TI polling thread, the only producer of the ring, keeps reading
+   out the blocks left in the TI, and the ROC output thread keeps
+   emptying the ring.  Return as soon as both are empty, or give up on
+   whichever stage has made no progress for its timeout (ms). */
+#ifndef END_TI_TIMEOUT
+#define END_TI_TIMEOUT   2000 /* Blocks ready in the TI, none read out */
+#endif
+#ifndef END_OUT_TIMEOUT
+#define END_OUT_TIMEOUT  2000 /* Events in the ring, none taken by the ROC */
+#endif
+#ifndef END_ACK_TIMEOUT
+#define END_ACK_TIMEOUT   500 /* TI block status set, no blocks ready */
+#endif
+int rocEndTiTimeout=END_TI_TIMEOUT;
+int rocEndOutTimeout=END_OUT_TIMEOUT;
+int rocEndAckTimeout=END_ACK_TIMEOUT;
+/* Set by the user list to name the modules (slots) that held up its
+   readout, when a stage times out */
+void (*rocEndStuckHook)() = NULL;
+
+static int
+rocEndDrain()
+{
+  struct timespec ts = {0, 1000000};
+  int bready, nring, lastready=-1, lastring=-1, timeout;
+  unsigned int blockstatus, startcount = tiGetIntCount();
+  unsigned long long now, tstart, tprogress, tprint;
+  char *stage;
+
+  tstart = tprogress = tprint = rocTimeNs();
+
+  while(1)
+    {
+      bready      = tiBReady();
+      nring       = rocRingCount(&rocRing) + rocRingCount(&rocUserRing);
+      blockstatus = tiBlockStatus(0,0);
+      now         = rocTimeNs();
+
+      if((bready == 0) && (nring == 0) && (blockstatus == 0) &&
+	 (rocUserActive == 0))
+	break;
+
+      if((bready != lastready) || (nring != lastring))
+	{
+	  tprogress = now;
+	  lastready = bready;
+	  lastring  = nring;
+	}
+
+      if((now - tprint) > 500000000ULL)
+	{
+	  printf("%s: blocks ready = %d  events queued = %d  blockstatus = 0x%x  (%d blocks read)\n",
+		 __func__, bready, nring, blockstatus, tiGetIntCount() - startcount);
+	  tprint = now;
+	}
+
+      if(bready > 0)
+	{
+	  stage = "TI readout";
+	  timeout = rocEndTiTimeout;
+	}
+      else if(nring > 0)
+	{
+	  stage = "ROC output";
+	  timeout = rocEndOutTimeout;
+	}
+      else if(rocUserActive)
+	{
+	  stage = "User event thread";
+	  timeout = rocEndOutTimeout;
+	}
+      else
+	{
+	  stage = "TI block status";
+	  timeout = rocEndAckTimeout;
+	}
+
+      if((now - tprogress) > (unsigned long long)timeout*1000000ULL)
+	{
+	  daLogMsg("WARN","End: %s stuck for %d ms (blocks ready = %d, events queued = %d, blockstatus = 0x%x)",
+		   stage, timeout, bready, nring, blockstatus);
+	  if(rocEndStuckHook)
+	    (*rocEndStuckHook)();
+	  return ERROR;
+	}
+
+      nanosleep(&ts, NULL);
+    }
+
+  printf("%s: Drained %d blocks in %llu ms\n", __func__,
+	 tiGetIntCount() - startcount, (rocTimeNs() - tstart)/1000000ULL);
+
+  return OK;
+}
 
 /*! Buffer node pointer */
 extern DMANODE *the_event;
@@ -107,6 +857,39 @@ extern unsigned int *dma_dabufp;
 #define RESET_EVTYPE(a) {						\
     the_event->data[0] = (the_event->data[0] &~ 0x00ff0000) | ((a & 0xff)<<16); \
 }
+
+/* Words left in the current event buffer */
+static inline int
+rocEventWordsLeft()
+{
+  return (int)((the_event->part->size - sizeof(DMANODE)) / sizeof(unsigned int))
+    - (int)(dma_dabufp - (unsigned int *)&the_event->data[0]);
+}
+
+/* Buffer a module block that does not fit in the event buffer is read
+   into and thrown away.  One event buffer long, made at Download. */
+static DMANODE *rocDropNode = NULL;
+unsigned int *rocDropBuf = NULL;
+
+/* Guard before a module DMA into the event buffer: nwords, the largest
+   block the module can send, if that still leaves reserve words free,
+   or 0 if not.  On 0 the caller reads the block into rocDropBuf
+   instead, with the same limit, and leaves it out of the event.  The
+   module must be emptied of it: a block left behind, or the rest of a
+   shorter read, would come out in place of the next one, and the
+   modules would no longer follow the TI.  A dropped block is logged. */
+int
+rocDmaLimit(int nwords, int reserve, unsigned int event, int slot)
+{
+  int left = rocEventWordsLeft() - reserve;
+
+  if(nwords <= left)
+    return nwords;
+
+  rocErrLog(ROCERR_NO_SPACE, event, slot, left, nwords);
+
+  return 0;
+}
 #else
 #define dma_dabufp (rol->dabufp)
 #define the_event (rol)
@@ -119,6 +902,16 @@ extern unsigned int *dma_dabufp;
   }
 DANODE *end_event[256]; /* Pointers to end event buffers */
 int nend_event; /* Number of event event buffers actually acquired */
+
+unsigned int rocErrCount[NROCERR];
+
+void
+rocErrLog(int eclass, unsigned int event, unsigned int a0, unsigned int a1,
+	  unsigned int a2)
+{
+  rocErrCount[eclass]++;
+  logMsg(rocErrFormat[eclass], event, a0, a1, a2, 0, 0);
+}
 #endif
 
 /* ROC Function prototypes defined by the user */
@@ -136,11 +929,155 @@ int  getInQueueCount();
 /* Asynchronous (to tiprimary rol) trigger routine, connects to rocTrigger */
 void asyncTrigger();
 
-/* Input and Output Partitions for Linux VME Readout */
+/* Return the value of an integer parameter from the rol->usrConfig file,
+   given as a line "KEY value" (# starts a comment), or defval if the
+   key is not there. */
+int
+rocConfigInt(char *key, int defval)
+{
+  FILE *f;
+  char line[256], name[80];
+  int val, rval = defval;
+
+  if((rol->usrConfig == NULL) || ((f = fopen(rol->usrConfig, "r")) == NULL))
+    return defval;
+
+  while(fgets(line, sizeof(line), f) != NULL)
+    {
+      if((sscanf(line, "%79s %i", name, &val) == 2) && (strcmp(name, key) == 0))
+	rval = val;
+    }
+  fclose(f);
+
+  return rval;
+}
+
+/* Input Partition for Linux VME Readout */
 #ifdef LINUX
-DMA_MEM_ID vmeIN, vmeOUT;
+DMA_MEM_ID vmeIN;
 int emptyCount = 0;   /* Count the number of times event buffers are empty */
 int errCount = 0;     /* Count the number of times no buffer available from vmeIN */
+
+/* Event buffer pool sizing.
+   MAX_EVENT_LENGTH * MAX_EVENT_POOL is the memory budget for vmeIN.  The
+   length of each buffer is set at Download from the largest block the
+   user list says it can produce (rocSetEventLength), or MAX_EVENT_LENGTH
+   if it does not say.  The budget not needed for a buffer goes into
+   more buffers.
+   With ROC_POOL_SHRINK 1 in the usrConfig file, the buffers are cut at
+   Prestart to twice the largest event of the previous run, for still
+   more of them.  A module block that does not fit is then dropped
+   (rocDmaLimit()), so only use it for a run like the one before. */
+#ifndef POOL_SHRINK
+#define POOL_SHRINK        0
+#endif
+#ifndef EVENT_LENGTH_MIN
+#define EVENT_LENGTH_MIN   16384 /* Smallest buffer (bytes) */
+#endif
+#ifndef EVENT_POOL_LIMIT
+#define EVENT_POOL_LIMIT   128   /* Most buffers (less than ROC_RING_SIZE) */
+#endif
+unsigned int rocEventLengthMax = 0;   /* Largest block (bytes) from the user list, 0 = unknown */
+unsigned int rocEventLength    = 0;   /* Current buffer length (bytes) */
+int          rocEventPool      = 0;   /* Current number of buffers */
+unsigned int rocEventHighWater = 0;   /* Largest event (bytes) this run */
+int          rocPoolShrink     = POOL_SHRINK;
+
+/* Called from rocDownload() with the largest block, in bytes, the
+   current configuration can produce */
+void
+rocSetEventLength(unsigned int nbytes)
+{
+  rocEventLengthMax = nbytes;
+}
+
+/* Touch every page of every vmeIN buffer so the first events of a run
+   do not take page faults */
+static void
+rocEventPoolPrefault()
+{
+  DMANODE *node[EVENT_POOL_LIMIT];
+  int inode, nnode = 0;
+  unsigned int iword, nword;
+
+  while((nnode < EVENT_POOL_LIMIT) && ((node[nnode] = dmaPGetItem(vmeIN)) != NULL))
+    nnode++;
+
+  for(inode = 0; inode < nnode; inode++)
+    {
+      nword = (node[inode]->part->size - sizeof(DMANODE)) / sizeof(unsigned int);
+      for(iword = 0; iword < nword; iword += 1024)
+	node[inode]->data[iword] = 0;
+      dmaPFreeItem(node[inode]);
+    }
+}
+
+/* The buffer of dropped module blocks (rocDmaLimit()), as long as the
+   largest event buffer */
+static void
+rocDropCreate()
+{
+  DMA_MEM_ID rocDrop;
+  unsigned int length = rocEventLengthMax ? rocEventLengthMax : MAX_EVENT_LENGTH;
+
+  /* Freed with the other partitions at Download */
+  rocDrop = dmaPCreate("rocDrop", (length + 0xfff) & ~0xfff, 1, 0);
+  rocDropNode = rocDrop ? dmaPGetItem(rocDrop) : NULL;
+  rocDropBuf = rocDropNode ? (unsigned int *)&rocDropNode->data[0] : NULL;
+  if(rocDropBuf == NULL)
+    daLogMsg("ERROR","Unable to allocate memory for dropped module blocks");
+}
+
+/* (Re)create vmeIN with buffers of at least nbytes */
+static void
+rocEventPoolCreate(unsigned int nbytes)
+{
+  unsigned int length, maxlength = MAX_EVENT_LENGTH;
+  int pool;
+
+  if(rocEventLengthMax && (rocEventLengthMax < maxlength))
+    maxlength = rocEventLengthMax;
+
+  length = nbytes;
+  if(length > maxlength)
+    length = maxlength;
+  if(length < EVENT_LENGTH_MIN)
+    length = EVENT_LENGTH_MIN;
+  length = (length + 0xfff) & ~0xfff; /* Whole pages */
+
+  pool = ((double)MAX_EVENT_LENGTH * MAX_EVENT_POOL) / length;
+  if(pool < MAX_EVENT_POOL)
+    pool = MAX_EVENT_POOL;
+  if(pool > EVENT_POOL_LIMIT)
+    pool = EVENT_POOL_LIMIT;
+
+  if(vmeIN && (length == rocEventLength) && (pool == rocEventPool))
+    return;
+
+  /* Only vmeIN: the user list may have partitions of its own */
+  if(vmeIN)
+    dmaPFree(vmeIN);
+  vmeIN  = dmaPCreate("vmeIN",length,pool,0);
+  rocRingReset(&rocRing);
+  rocRingReset(&rocFreeRing);
+
+  if(vmeIN == 0)
+    {
+      daLogMsg("ERROR", "Unable to allocate memory for event buffers");
+      rocEventLength = 0;
+      rocEventPool = 0;
+      return;
+    }
+
+  rocEventLength = length;
+  rocEventPool = pool;
+  daLogMsg("INFO","Event buffers: %d x %d bytes", pool, length);
+
+  /* Reinitialize the Buffer memory */
+  dmaPReInit(vmeIN);
+  rocEventPoolPrefault();
+  dmaPStatsAll();
+}
 #endif
 
 /**
@@ -163,9 +1100,40 @@ static void __download()
 #endif
 
 #ifdef LINUX
-  pthread_mutex_init(&ack_mutex, NULL);
-  pthread_cond_init(&ack_cv,NULL);
-  pthread_cond_init(&endrun_cv,NULL);
+  /* Thread scheduling and memory locking */
+  rocReadoutCpu  = rocConfigInt("ROC_READOUT_CPU", READOUT_CPU);
+  rocReadoutPrio = rocConfigInt("ROC_READOUT_PRIO", READOUT_PRIO);
+  rocOutputCpu   = rocConfigInt("ROC_OUTPUT_CPU", OUTPUT_CPU);
+  rocOutputPrio  = rocConfigInt("ROC_OUTPUT_PRIO", OUTPUT_PRIO);
+
+  rocDiagMode = rocConfigInt("ROC_DIAG", DIAG_MODE);
+  unlink(DIAG_FILE);  /* Left from an earlier run: ROC_DIAG applies */
+
+#ifdef TI_MASTER
+  rocAdaptOn  = rocConfigInt("ROC_BLOCK_ADAPT", 0);
+  rocAdaptMax = rocConfigInt("ROC_BLOCK_MAX", ADAPT_BLOCK_MAX);
+  rocAdaptHook = NULL;  /* Set by rocDownload() */
+#endif
+  rocEndStuckHook = NULL;  /* Set by rocDownload() */
+
+  rocPoolShrink = rocConfigInt("ROC_POOL_SHRINK", POOL_SHRINK);
+
+  rocBatchMax = rocConfigInt("ROC_BATCH_MAX", BATCH_MAX);
+  if(rocBatchMax < 1)
+    rocBatchMax = 1;
+  if(rocBatchMax > BATCH_LIMIT)
+    rocBatchMax = BATCH_LIMIT;
+
+  /* End of run drain timeouts (ms) */
+  rocEndTiTimeout  = rocConfigInt("ROC_END_TI_TIMEOUT", END_TI_TIMEOUT);
+  rocEndOutTimeout = rocConfigInt("ROC_END_OUT_TIMEOUT", END_OUT_TIMEOUT);
+  rocEndAckTimeout = rocConfigInt("ROC_END_ACK_TIMEOUT", END_ACK_TIMEOUT);
+
+  if(rocConfigInt("ROC_MLOCK", MLOCK_MEMORY))
+    {
+      if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+	daLogMsg("WARN","Unable to lock ROC memory (%s)", strerror(errno));
+    }
 
   /* /\* Open the default VME windows *\/ */
   /* vmeOpenDefaultWindows(); */
@@ -173,17 +1141,16 @@ static void __download()
   /* Initialize memory partition library */
   dmaPartInit();
 
-  /* Setup Buffer memory to store events */
+  /* Release the event buffers.  They are sized after rocDownload().
+     The user ring must not keep nodes of the freed partitions. */
+  rocRingReset(&rocUserRing);
+  rocRingReset(&rocFreeRing);
   dmaPFreeAll();
-  vmeIN  = dmaPCreate("vmeIN",MAX_EVENT_LENGTH,MAX_EVENT_POOL,0);
-  vmeOUT = dmaPCreate("vmeOUT",0,0,0);
-
-  if(vmeIN == 0)
-    daLogMsg("ERROR", "Unable to allocate memory for event buffers");
-
-  /* Reinitialize the Buffer memory */
-  dmaPReInitAll();
-  dmaPStatsAll();
+  vmeIN = 0;
+  rocDropNode = NULL;
+  rocDropBuf = NULL;
+  rocEventLengthMax = 0;
+  rocEventHighWater = 0;
 #else
   partStatsAll();
 #endif
@@ -212,6 +1179,14 @@ static void __download()
   /* Execute User defined download */
   rocDownload();
 
+#ifdef LINUX
+  /* Setup Buffer memory to store events */
+  if(rocEventLengthMax == 0)
+    daLogMsg("WARN","Largest event not set by rocDownload().  Event buffers of MAX_EVENT_LENGTH");
+  rocEventPoolCreate(rocEventLengthMax ? rocEventLengthMax : MAX_EVENT_LENGTH);
+  rocDropCreate();
+#endif
+
   daLogMsg("INFO","Download Executed");
 
   tiDisableVXSSignals();
@@ -236,9 +1211,11 @@ static void __download()
 static void __prestart()
 {
 #ifdef LINUX
-  ACKLOCK;
+  rocUserActive=0;
+
   ack_runend=0;
-  ACKUNLOCK;
+  rocReadoutSched = ((rocReadoutCpu >= 0) || (rocReadoutPrio > 0));
+  rocOutputSched  = ((rocOutputCpu >= 0) || (rocOutputPrio > 0));
 #endif
   vmeCheckMutexHealth(10);
 
@@ -265,6 +1242,30 @@ static void __prestart()
   /* Execute User defined prestart */
   rocPrestart();
 
+#ifdef LINUX
+  if(rocAdaptOn)
+    {
+      if(rocAdaptHook == NULL)
+	{
+	  daLogMsg("WARN","ROC_BLOCK_ADAPT: not supported by this readout list");
+	  rocAdaptOn = 0;
+	}
+      else
+	tiSetSyncEventInterval(ADAPT_SYNC_INTERVAL);
+    }
+
+  /* Cut the event buffers to twice the largest event of the last run
+     (ROC_POOL_SHRINK).  Not with an adaptive block level: the largest
+     block is not known from the last run. */
+  if(rocPoolShrink && rocEventHighWater && !rocAdaptOn)
+    {
+      printf("%s: Largest event of last run: %d bytes\n",
+	     __FUNCTION__, rocEventHighWater);
+      rocEventPoolCreate(2*rocEventHighWater);
+      rocEventHighWater = 0;
+    }
+#endif
+
   /* If the TI Master, send a Sync Reset */
   if(tsCrate)
     {
@@ -303,16 +1304,25 @@ static void __go()
 
   daLogMsg("INFO","Entering Go");
 #ifdef LINUX
-  ACKLOCK;
   ack_runend=0;
-  ACKUNLOCK;
   emptyCount=0;
   errCount=0;
+  memset(rocHandoffHist, 0, sizeof(rocHandoffHist));
+  memset(rocBatchHist, 0, sizeof(rocBatchHist));
+  rocBatchExtra = 0;
+  rocRingFullHeld = rocRingFullDropped = 0;
+  rocHandoffCount=0;
+  rocHandoffMax=0;
 #endif
 
   CDOENABLE(TIPRIMARY,1,1);
   rocGo();
 
+#ifdef LINUX
+  if(rocAdaptOn)
+    rocAdaptStart();
+#endif
+
 #ifdef VXWORKS
   if( MAX_EVENT_POOL == (BUFFERLEVEL * 2) )
     nend_event = BUFFERLEVEL;
@@ -328,6 +1338,10 @@ static void __go()
   tsLiveCalc = 1;
   tsLiveFunc = (FUNCPTR)&tiLive;
 
+#ifdef LINUX
+  rocErrLogStart();
+#endif
+
   tiIntEnable(1);
 
   if (__the_event__) WRITE_EVENT_;
@@ -356,16 +1370,10 @@ static void __end()
   blockstatus = tiBlockStatus(0,0);
   printf("__end: blockstatus=%d\n",blockstatus);
 
-  ACKLOCK;
   ack_runend=1;
-  if(blockstatus)
-    {
-      printf("%s: Clearing data from TI (blockstatus = 0x%x)\n",__FUNCTION__, blockstatus);
-      ENDRUN_TIMEDWAIT(30);
-      printf("%s: endrun_timedwait_ret = %d   blockstatus = 0x%x\n",
-	     __FUNCTION__,endrun_timedwait_ret,tiBlockStatus(0,0));
-    }
-  ACKUNLOCK;
+  if(rocEndDrain() != OK)
+    printf("%s: Drain incomplete.  blocks ready = %d  blockstatus = 0x%x\n",
+	   __FUNCTION__, tiBReady(), tiBlockStatus(0,0));
 
   INTLOCK;
   INTUNLOCK;
@@ -403,12 +1411,23 @@ static void __end()
 
 #endif
   printf("---- DONE with purge of TI blocks\n");
+#ifdef LINUX
+  rocBatchReport();
+  rocHandoffReport();
+  rocRingFullDone();  /* The readout is idle after the drain */
+  rocErrLogStop();
+#endif
 
   tiIntDisable();
   tiIntDisconnect();
 
   /* Execute User defined end */
   rocEnd();
+#ifdef LINUX
+  /* User events left after a drain that timed out */
+  rocUserRingFlush();
+  rocFreeRingFlush();
+#endif
 
   CDODISABLE(TIPRIMARY,1,0);
 
@@ -426,25 +1445,46 @@ static void __end()
 #ifdef LINUX
 void linuxusrtrig(unsigned long EVTYPE,unsigned long EVSOURCE)
 {
-  int ii, len;
-  int syncFlag=0;
-  unsigned int currentWord=0;
+  int len, blklevel;
   DMANODE *outEvent;
+  unsigned long long puttime=0;
 
-  outEvent = dmaPGetItem(vmeOUT);
+  if(rocOutputSched)
+    {
+      rocThreadSched("Output", rocOutputCpu, rocOutputPrio);
+      rocOutputSched = 0;
+    }
+
+  /* User events (one event each) are few; take them first */
+  outEvent = rocRingGet(&rocUserRing, &puttime, &blklevel);
+  if(outEvent == NULL)
+    {
+      outEvent = rocRingGet(&rocRing, &puttime, &blklevel);
+      if(outEvent != NULL)
+	rocHandoffFill(rocTimeNs() - puttime);
+    }
 
   if(outEvent != NULL)
     {
       len = outEvent->length;
-      CEOPEN(ROCID, BT_BANK, blockLevel);
+      CEOPEN(ROCID, BT_BANK, blklevel);
 
       if(rol->dabufp != NULL)
 	{
-	  for(ii=0;ii<len;ii++)
-	    {
-	      currentWord = (outEvent->data[ii]);
-	      *rol->dabufp++ = currentWord;
-	    }
+	  /* The ROC output buffer is not in DMA memory, so the payload
+	     must be moved once more.  Do it as a single bulk copy. */
+#ifdef ROC_COPY_WORDS
+	  /* The word at a time copy it replaced, to compare (make -C emu bench) */
+	  {
+	    int ii;
+	    for(ii = 0; ii < len; ii++)
+	      *rol->dabufp++ = outEvent->data[ii];
+	  }
+#else
+	  memcpy((void *)rol->dabufp, (void *)outEvent->data,
+		 len*sizeof(unsigned int));
+	  rol->dabufp += len;
+#endif
 	}
       else
 	{
@@ -453,47 +1493,70 @@ void linuxusrtrig(unsigned long EVTYPE,unsigned long EVSOURCE)
 
       CECLOSE;
 
-      ACKLOCK;
-
-      dmaPFreeItem(outEvent);
-
-      if(tiNeedAck>0)
-	{
-	  tiNeedAck=0;
-	  ACKSIGNAL;
-	}
-
-      if(ack_runend)
+      /* Give a vmeIN buffer back to the readout through rocFreeRing,
+	 where a producer waiting in asyncTrigger() sees it.  User
+	 events, and a buffer that does not fit, go to their partition. */
+      if(outEvent->part == vmeIN)
 	{
-	  if(tiBlockStatus(0,0)==0)
-	    ENDRUN_SIGNAL;
+	  outEvent->length = 0;  /* Handed out empty, as by dmaPFreeItem() */
+	  if(rocRingPut(&rocFreeRing, outEvent, 0) == OK)
+	    {
+	      rocRingPublish(&rocFreeRing);
+	      outEvent = NULL;
+	    }
 	}
-
-      ACKUNLOCK;
+      if(outEvent != NULL)
+	dmaPFreeItem(outEvent);
     }
   else
     {
-      logMsg("Error: no Event in vmeOUT queue\n",0,0,0,0,0,0);
+      logMsg("Error: no Event in output ring\n",0,0,0,0,0,0);
     }
 
 } /*end trigger */
 
-void asyncTrigger()
+/* A free vmeIN buffer: one given back through rocFreeRing, else one
+   still in the partition (each buffer, the first time round) */
+static DMANODE *
+rocEventGet()
 {
-  int intCount=0;
-  int length,size;
+  DMANODE *node;
+  unsigned long long puttime;
+  int level;
+
+  node = rocRingGet(&rocFreeRing, &puttime, &level);
+  if((node == NULL) && !dmaPEmpty(vmeIN))
+    node = dmaPGetItem(vmeIN);
+
+  return node;
+}
+
+/* No free vmeIN buffer */
+static int
+rocEventNone()
+{
+  return ((rocRingCount(&rocFreeRing) == 0) && dmaPEmpty(vmeIN));
+}
 
-  intCount = tiGetIntCount();
+/* Read out one block into a vmeIN buffer and put it in the output ring.
+   The ring is published by the caller. */
+static int
+rocReadoutBlock(int intCount)
+{
+  int length,size,level;
 
-  /* grap a buffer from the queue */
-  GETEVENT(vmeIN,intCount);
-  if(the_event == NULL)
+  /* grap a free buffer, as GETEVENT(vmeIN,intCount) */
+  the_event = rocEventGet();
+  if(the_event != NULL)
+    {
+      the_event->nevent = intCount;
+      dma_dabufp = (unsigned int *)&the_event->data[0];
+    }
+  else
     {
-      if(errCount == 0)
-	daLogMsg("ERROR","asyncTrigger: No DMA Buffer Available. Events could be out of sync!");
-      printf("asyncTrigger:ERROR: No buffer available!\n");
+      rocErrLog(ROCERR_NO_BUFFER, intCount, 0, 0, 0);
       errCount++;
-      return;
+      return ERROR;
     }
 
   if(the_event->length!=0)
@@ -503,40 +1566,116 @@ void asyncTrigger()
     }
 
   /* Execute user defined Trigger Routine */
+  level = blockLevel;
   rocTrigger();
 
-  /* Put this event's buffer into the OUT queue. */
-  ACKLOCK;
-  PUTEVENT(vmeOUT);
+  if(rocAdaptOn)
+    rocAdaptBlock();
+
+  /* Event length in words, as PUTEVENT would record it */
+  the_event->length = dma_dabufp - (unsigned int *)&the_event->data[0];
 
   /* Check if the event length is larger than expected */
-  length = (((int)(dma_dabufp) - (int)(&the_event->length))) - 4;
+  length = the_event->length * sizeof(unsigned int);
   size = the_event->part->size - sizeof(DMANODE);
 
+  if(length > rocEventHighWater)
+    rocEventHighWater = length;
+
   if(length>size)
+    rocErrLog(ROCERR_OVERFLOW, the_event->nevent, length, size, 0);
+
+  /* Put this event's buffer into the output ring.  If it is full, hold
+     the readout (and so the TI) until the output thread takes an event.
+     Only drop the event at End, if the output thread has stopped. */
+  if(rocRingPut(&rocRing, the_event, level) != OK)
     {
-      printf("rocLib: ERROR: Event length > Buffer size (%d > %d).  Event %ld\n",
-	     length,size,the_event->nevent);
-      daLogMsg("WARN", "Event buffer overflow");
+      unsigned long long twait = rocTimeNs(), tnow = twait;
+      int iwait = 0;
+
+      if(rocRingFullHeld++ == 0)
+	{
+	  rocRingFullStart = twait;
+	  rocRingFullEvent = the_event->nevent;
+	}
+
+      /* Let the output thread see the events read before this one */
+      rocRingPublish(&rocRing);
+
+      while(rocRingPut(&rocRing, the_event, level) != OK)
+	{
+	  rocRingBackoff(iwait++);
+	  tnow = rocTimeNs();
+	  if(ack_runend &&
+	     ((tnow - twait) > (unsigned long long)rocEndOutTimeout*1000000ULL))
+	    {
+	      dmaPFreeItem(the_event);
+	      rocRingFullDropped++;
+	      break;
+	    }
+	}
+      rocRingFullStop = tnow;
     }
+  else
+    rocRingFullDone();
+
+  return OK;
+}
+
+void asyncTrigger()
+{
+  int intCount=0;
+  int nblock=0;
 
-  if(dmaPEmpty(vmeIN))
+  if(rocReadoutSched)
     {
+      rocThreadSched("Readout", rocReadoutCpu, rocReadoutPrio);
+      rocReadoutSched = 0;
+    }
 
-      printf("WARN: vmeIN out of event buffers (intCount = %d).\n",intCount);
+  /* tiIntCount counts interrupts.  Blocks read after the first one in
+     a call are numbered from it with rocBatchExtra. */
+  intCount = tiGetIntCount() + rocBatchExtra;
 
-      if((ack_runend == 0) || (tiBReady() > 0))
-	{
-	  /* Set the NeedAck for Ack after a buffer is freed */
-	  tiNeedAck = 1;
+  if(rocReadoutLock)
+    vmeBusLock();
 
-	  /* Wait for the signal indicating that a buffer has been freed */
-	  ACKWAIT;
-	}
+  while(rocReadoutBlock(intCount) == OK)
+    {
+      nblock++;
+
+      if((nblock >= rocBatchMax) || rocEventNone() || (tiBReady() <= 0))
+	break;
 
+      /* Another block is buffered in the TI.  The polling thread
+	 acknowledges one block when this call returns; acknowledge
+	 the one just read through the library. */
+      tiIntAck();
+      rocBatchExtra++;
+      intCount++;
     }
 
-  ACKUNLOCK;
+  if(rocReadoutLock)
+    vmeBusUnlock();
+
+  if(nblock == 0)
+    return;
+
+  rocRingPublish(&rocRing);
+  rocBatchHist[nblock]++;
+
+  if(rocEventNone())
+    {
+      int iwait=0;
+
+      emptyCount++;
+
+      /* Hold off the next trigger until the output thread frees a buffer */
+      tiNeedAck = 1;
+      while(rocEventNone() && ((ack_runend == 0) || (tiBReady() > 0)))
+	rocRingBackoff(iwait++);
+      tiNeedAck = 0;
+    }
 }
 
 void linuxusrtrig_done()
@@ -600,17 +1739,14 @@ void __status()
 int
 getOutQueueCount()
 {
-  if(vmeOUT)
-    return(dmaPNodeCount(vmeOUT));
-  else
-    return(0);
+  return(rocRingCount(&rocRing) + rocRingCount(&rocUserRing));
 }
 
 int
 getInQueueCount()
 {
   if(vmeIN)
-    return(dmaPNodeCount(vmeIN));
+    return(dmaPNodeCount(vmeIN) + rocRingCount(&rocFreeRing));
   else
     return(0);
 }
@@ -647,6 +1783,10 @@ __attribute__((destructor)) void end (void)
 
 void __reset()
 {
+#ifdef LINUX
+  rocRingReset(&rocUserRing);
+  rocRingReset(&rocFreeRing);
+#endif
   dmaPFreeAll();
   rocCleanup();
 }
@@ -20,6 +20,9 @@
 #define VETROC_SLOT 15					/* of first vetroc in crate */
 #define VETROC_SLOT_INCR 2			/* slot spacing of vetrocs */
 #define NVETROC	2								/* number of vetrocs used */
+#define VETROC_A32_BASE 0x09000000	/* A32 base of the VETROC block data registers */
+#define VETROC_READY_TIMEOUT 1000  /* Longest wait for a VETROC block (us) */
+#define VETROC_ROMODE 1  /* Readout Mode: 0 = SCT, 1 = Single Board DMA, 2 = MultiBoard DMA */
 
 /* Measured longest fiber length in system */
 #define FIBER_LATENCY_OFFSET 0x4A  
@@ -27,14 +30,30 @@
 #include "dmaBankTools.h"   /* Macros for handling CODA banks */
 #include "tiprimary_list.c" /* Source required for CODA readout lists using the TI */
 #include "vetrocLib.h"      /* VETROC library */
+#include "rocWait.h"        /* Module block ready wait */
+
+/* Most words in one VETROC read: MultiBoard DMA reads all boards at once */
+#if(VETROC_ROMODE==2)
+#define VETROC_READ_WORDS (nvetroc*MAXVETROCDATA)
+#else
+#define VETROC_READ_WORDS MAXVETROCDATA
+#endif
 
 /* Define initial blocklevel and buffering level */
 #define BLOCKLEVEL 1
 #define BUFFERLEVEL 4
 
+static rocWaitStat vtWait = {"VETROC"};
 static unsigned int vetrocSlotMask=0;
 int nvetroc=0;		// number of vetrocs in the crate
-unsigned long *tdcbuf;
+extern int vetrocA32Base;                      /* Minimum VME A32 Address for use by VETROCs */
+
+/* Modules that held up the End drain (rocEndStuckHook) */
+static void
+endStuck()
+{
+  rocWaitStuck(&vtWait);
+}
 
 /****************************************
  *  DOWNLOAD
@@ -112,13 +131,12 @@ rocDownload()
   /*****************
    *   VETROC SETUP
    *****************/
-	
-	tdcbuf = (unsigned long *)malloc(MAXVETROCDATA*sizeof(unsigned long));
 
 /* 0 = software synch-reset, FP input 1, internal clock */
 //	iflag = 0x20;  /* FP 1  0x020;  MAY NEED TO BE CHANGED*/
 	iflag = 0x111; /* vxs sync-reset, trigger, clock */
 
+	vetrocA32Base = VETROC_A32_BASE;
 	nvetroc = vetrocInit((VETROC_SLOT<<19),(VETROC_SLOT_INCR<<19) , NVETROC, iflag);
 	if (nvetroc <= 0) {
 		printf("ERROR: no VETROC !!! \n");
@@ -140,8 +158,19 @@ rocDownload()
 		vetrocStatus(vetrocSlot(ivt), 0);
 	}
 
+#if(VETROC_ROMODE==2)
+	vetrocEnableMultiBlock();
+#endif
+
   tiStatus(0);
 
+  rocEndStuckHook = endStuck;
+
+  /* Largest block this configuration can produce, to size the event buffers */
+  rocSetEventLength(4*((8 + 5*blockLevel)                /* TI trigger bank */
+		       + 6                                 /* Bank 5 */
+		       + 2 + NVETROC*(2 + MAXVETROCDATA)));  /* Bank 3 */
+
   printf("rocDownload: User Download Executed\n");
 
 }
@@ -185,6 +214,8 @@ rocGo()
   blockLevel = tiGetCurrentBlockLevel();
   printf("rocGo: Block Level set to %d\n",blockLevel);
 
+  rocWaitClear(&vtWait);
+
   /* Interrupts/Polling enabled after conclusion of rocGo() */
 
   /* Example: How to start internal pulser trigger */
@@ -223,6 +254,8 @@ rocEnd()
   tiStatus(0);	
 
   printf("rocEnd: Ended after %d blocks\n",tiGetIntCount());
+
+  rocWaitReport(&vtWait);
   
 }
 
@@ -232,14 +265,14 @@ rocEnd()
 void
 rocTrigger(int arg)
 {
-  int ii, gbready, itime, read_stat;
+  int gbready, read_stat;
   int ivt, nwords, blockError, dCnt, len=0, idata;
   unsigned int val;
   unsigned int *start;
   unsigned int datascan, scanmask, roCount;
 
-  /* Set TI output 1 high for diagnostics */
-  tiSetOutputPort(1,0,0,0);
+  /* Set TI output 1 high for diagnostics, if enabled */
+  ROC_DIAG_START;
 
   roCount = tiGetIntCount(); //Get the TI trigger count
 
@@ -249,7 +282,7 @@ rocTrigger(int arg)
 
   if(dCnt<=0)
     {
-      printf("No TI Trigger data or error.  dCnt = %d\n",dCnt);
+      rocErrLog(ROCERR_TI_READ, roCount, dCnt, 0, 0);
     }
   else
     { /* TI Data is already in a bank structure.  Bump the pointer */
@@ -268,42 +301,43 @@ rocTrigger(int arg)
 	BANKOPEN(3,BT_UI4,0);
 
 	/* Check for valid data in VETROC */
-	read_stat = 0;
-
-	for(itime=0; itime<1000; itime++) 
-	{
-		gbready = vetrocGBready();
-		read_stat = (gbready == vetrocSlotMask);
-
-		if (read_stat>0)
-		{ 
-			break;
-		}
-   }
+	gbready = rocWaitReady(&vtWait, vetrocGBready, vetrocSlotMask,
+			       VETROC_READY_TIMEOUT);
+	read_stat = (gbready == vetrocSlotMask);
 		
 //	*dma_dabufp++ = LSWAP(0xb0b0b0b4); /* First word */ 
 //	*dma_dabufp++ = LSWAP(read_stat);
 	
 	if(read_stat>0) 
-	{ /* read the data here */
+	{ /* read the data here, straight into the event buffer */
+#if(VETROC_ROMODE==2)
+		ivt = 0;
+#else
 		for(ivt=0; ivt<nvetroc; ivt++)
+#endif
 		{
-			nwords = vetrocReadFIFO(vetrocSlot(ivt), &tdcbuf[0], MAXVETROCDATA, 1);
-
 			*dma_dabufp++ = LSWAP(0xb0b0b0b4); /* First word */
+
+			/* skip 1 word so nwords is written before the data.  Keep
+			   room for the marker and count of the boards after this one */
+			nwords = rocDmaLimit(VETROC_READ_WORDS, 1 + 2*(nvetroc - ivt - 1),
+					     roCount, vetrocSlot(ivt));
+			if(nwords > 0)
+				nwords = vetrocReadBlock(vetrocSlot(ivt), dma_dabufp + 1, nwords,
+							 VETROC_ROMODE);
+			else if(rocDropBuf)  /* No room: empty the board, drop the block */
+				vetrocReadBlock(vetrocSlot(ivt), rocDropBuf, VETROC_READ_WORDS,
+						VETROC_ROMODE);
 			*dma_dabufp++ = LSWAP(nwords);
 
-			for (ii=0; ii<nwords; ii++) 
-			{
-  			*dma_dabufp++ = tdcbuf[ii];
- 
-			}
+			if(nwords > 0)
+				dma_dabufp += nwords;
 		}
 	}
 	BANKCLOSE;
 
-  /* Set TI output 0 low */
-  tiSetOutputPort(0,0,0,0);
+  /* Set TI outputs low */
+  ROC_DIAG_STOP;
 
 }
 
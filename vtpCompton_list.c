@@ -15,7 +15,7 @@
  *       triggers using the VETROC (and possible fADC250) data.  This
  *       output will go into TS Input #1 (???)
  *
- *     fADC250 Must be in slot 3.
+ *     fADC250 Must be in slot 3 (more fADC250s in the slots after it).
  *     VETROCs must be in slot 13 and 14.
  *
  * Hall A Compton DAQ Upgrade Crew:
@@ -28,9 +28,12 @@
  *
  *************************************************************************/
 
-/* Define initial blocklevel and buffering level */
+/* Define initial blocklevel and buffering level
+   (ROC_BLOCKLEVEL, ROC_BUFFERLEVEL in the usrConfig file, or from a
+   rocTune.h scan) */
 #define BLOCKLEVEL  1
 #define BUFFERLEVEL 4
+#define HOLDOFF     31 /* Trigger holdoff (x 480 ns), ROC_HOLDOFF */
 
 /* Event Buffer definitions */
 #define MAX_EVENT_POOL     10
@@ -45,11 +48,14 @@
 
 /* VETROC definitions *///#define USE_VETROC
 #define USE_VETROC
-#define MAXVETROCDATA 1200*BLOCKLEVEL
+#define VETROC_MAX_HITS 1197  /* Most TDC words of a board for one event (ROC_VETROC_MAX_HITS) */
 #define VETROC_SLOT 13					/* slot of first vetroc */
 #define VETROC_SLOT_INCR 1			/* slot increment */
 #define NVETROC	4								/* number of vetrocs used */
-#define VETROC_ROMODE 1  /* Readout Mode: 0 = SCT, 1 = Single Board DMA, 2 = MultiBoard DMA */
+#define VETROC_A32_BASE 0x09000000	/* A32 base of the VETROC block data registers */
+#define VETROC_ROMODE 1  /* Readout Mode: 0 = SCT, 1 = Single Board DMA, 2 = MultiBoard DMA,
+			    3 = alternate 1 and 2 by block (benchmark).  ROC_VETROC_ROMODE */
+#define VETROC_READY_TIMEOUT 1000  /* Longest wait for a VETROC block (us) */
 #define VETROC_READ_CONF_FILE {			\
     vetrocConfig("");				\
     if(rol->usrConfig)				\
@@ -58,12 +64,15 @@
 
 /* FADC definitions */
 #define USE_FADC
-#define NFADC     1							/* number of fadcs used */
+#define NFADC     1							/* number of fadcs used (ROC_NFADC) */
 #define FADC_ADDR (3<<19)			/* address of first fADC250 */
 #define FADC_INCR (1<<19)			/* increment address to find next fADC250 */
+#define FADC_MULTIBLOCK 1	/* Read all fADC250s with one token passing DMA when there
+				   is more than one (ROC_FADC_MULTIBLOCK) */
 #define FADC_WINDOW_LAT    500
 #define FADC_WINDOW_WIDTH  500
 #define FADC_MODE        		 1
+#define FADC_READY_TIMEOUT 1000   /* Longest wait for an FADC block (us) */
 #define FADC_READ_CONF_FILE {			\
     fadc250Config("");				\
     if(rol->usrConfig)				\
@@ -75,10 +84,21 @@
 
 /* Scaler definitions */
 #define SCAL_ADDR 0xa10000		/* Defined in SIS3801.h */
+#define SCAL_FIFO (SCAL_ADDR+0x100)	/* FIFO read window, for block transfers */
+#define SCAL_NCHAN 32			/* Words per FIFO entry */
+#define SCAL_MAX_ENTRIES 16		/* Most FIFO entries read per trigger */
+#define SCAL_BLT			/* Read FIFO entries with A24 BLT32 (comment out for single cycles) */
 
 /* Measured longest fiber length in system */
 #define FIBER_LATENCY_OFFSET 0x4A
 
+/* Pad module DMA destinations to 8 bytes (ROC_DMA_ALIGN): 0 = off, 1 = on,
+   2 = every other block, to compare transfer rates (see rocDmaAlign.h) */
+#define DMA_ALIGN 0
+
+/* Readout profiler: time each phase of rocTrigger, report at End */
+//#define ROC_PROFILE
+
 /* Include */
 #include "dmaBankTools.h"   /* Macros for handling CODA banks */
 #include "tiprimary_list.c" /* Source required for CODA readout lists using the TI */
@@ -89,30 +109,314 @@
 #include "sdLib.h"
 #include "SIS3801.h"        /* 3801 scaler library */
 #include "SIS.h"            /* 3801 scaler library */
+#include "rocProfile.h"     /* rocTrigger phase profiler */
+#include "rocWait.h"         /* Module block ready wait */
+#include "rocTune.h"         /* Block level / buffer level / holdoff scan */
+#include "rocDmaSize.h"      /* Module block size from its configuration */
+#include "rocDmaAlign.h"     /* 64-bit aligned module DMA */
+#include "rocPulse.h"        /* Pulse parameters from the raw window data */
 
 /* SD variables */
 static unsigned int sdScanMask = 0;
 
 /* VETROC variables */
+static rocWaitStat vtWait = {"VETROC"};
 static unsigned int vetrocSlotMask=0;
 int nvetroc=0;		// number of vetrocs in the crate
 unsigned int *tdcbuf;
 extern int vetrocA32Base;                      /* Minimum VME A32 Address for use by VETROCs */
 
+/* VETROC readout mode, from ROC_VETROC_ROMODE.  In the benchmark mode
+   (VETROC_ROBENCH) blocks alternate between single board and multiboard
+   DMA, and the time, words and failed reads of each are reported at End. */
+#define VETROC_ROBENCH 3
+static int vtRoMode=VETROC_ROMODE;
+static int vtMultiBlock=0;  /* Multiboard token passing enabled */
+
+typedef struct
+{
+  unsigned int        blocks;  /* Blocks read in this mode */
+  unsigned int        errors;  /* Reads that returned no data */
+  unsigned long long  words;
+  unsigned long long  ns;      /* Time in the reads */
+} vtModeStat;
+
+static vtModeStat vtModeBench[3];
+
+/* Readout mode for this block.  Token passing is turned on or off to
+   match it. */
+static int
+vetrocBlockMode(unsigned int block)
+{
+  int romode = (vtRoMode == VETROC_ROBENCH) ? 1 + (block & 1) : vtRoMode;
+
+  if((romode == 2) && !vtMultiBlock)
+    {
+      vetrocEnableMultiBlock();
+      vtMultiBlock = 1;
+    }
+  else if((romode != 2) && vtMultiBlock)
+    {
+      vetrocDisableMultiBlock();
+      vtMultiBlock = 0;
+    }
+
+  return romode;
+}
+
+static void
+vetrocModeReport()
+{
+  int imode;
+  vtModeStat *st;
+  const char *name[3] = {"SCT", "DMA", "MultiBlock"};
+
+  printf("VETROC readout (ROC_VETROC_ROMODE %d):\n", vtRoMode);
+  for(imode = 0; imode < 3; imode++)
+    {
+      st = &vtModeBench[imode];
+      if(st->blocks == 0)
+	continue;
+      printf("  %-10s %10u blocks, %8.2f us/block, %8.1f MB/s, %u failed reads\n",
+	     name[imode], st->blocks, (st->ns/1000.)/st->blocks,
+	     st->ns ? (st->words*4*1000.)/st->ns : 0.,
+	     st->errors);
+    }
+}
+
 /* FADC variables */
+static rocWaitStat faWait = {"FADC250"};
 extern int fadcA32Base, nfadc;
-unsigned int MAXFADCWORDS = 2100*BLOCKLEVEL;	/* for calculation of max words in the block transfer */
+static int faMultiBlock=0;  /* One multiboard DMA for all fADC250s */
+unsigned int MAXFADCWORDS = 2100*BLOCKLEVEL;	/* max words in the block transfer, from the FADC configuration */
+
+/* VETROC block limit */
+static int vtMaxHits=VETROC_MAX_HITS;  /* ROC_VETROC_MAX_HITS */
+unsigned int MAXVETROCDATA = 1200*BLOCKLEVEL;	/* max words of one board's block, from vtMaxHits */
+
+/* TI buffering */
+int bufferLevel = BUFFERLEVEL;
+int holdoff = HOLDOFF;
+
+/* Words kept free in the event buffer by each module DMA, for the banks
+   written after it */
+#define DMA_RESERVE (4 + SCAL_MAX_ENTRIES*(SCAL_NCHAN+2) + 1 + 6 + 16)
+
+/* Largest FADC block for this block level (fixed limit if the mode is
+   not known to rocDmaSize.h) */
+static unsigned int
+fadcMaxWords(int level)
+{
+  unsigned int nwords = faGBlockWords(level);
+
+  return nwords ? nwords : 2100*level;
+}
+
+/* Block level changed by the TI at a sync event (ROC_BLOCK_ADAPT).
+   Called from the readout thread between blocks. */
+static void
+blockLevelChange(int level)
+{
+  MAXFADCWORDS = fadcMaxWords(level);
+  MAXVETROCDATA = vetrocBlockWords(level, vtMaxHits);
+#ifdef USE_FADC
+  faGSetBlockLevel(level);
+#endif
+#ifdef USE_VETROC
+  vetrocGSetBlockLevel(level);
+#endif
+}
+
+/* Modules that held up the End drain (rocEndStuckHook) */
+static void
+endStuck()
+{
+  rocWaitStuck(&faWait);
+  rocWaitStuck(&vtWait);
+}
 
 /* Scaler variables */
 int use_3801=1;
 
+/* Read pending SIS3801 FIFO entries (up to SCAL_MAX_ENTRIES) into buf,
+   each framed by 0xb2b2b000|k ... 0xda0000aa.  Returns the end of the
+   data written.
+   The FIFO has only status flags, no word count, so the status is
+   checked before each entry.  With blt an entry is one A24 BLT32
+   transfer instead of SCAL_NCHAN single cycles.  The DMA engine is
+   configured for the other modules between transfers, so use blt from
+   the readout thread only. */
+static unsigned int *
+sisReadFifo(unsigned int *buf, int blt, unsigned int roCount)
+{
+  int k, ii;
+#ifdef SCAL_BLT
+  unsigned int mask = LSWAP(DATA_MASK);
+  int shift, nbytes;
+
+  if(blt)
+    vmeDmaConfig(1,2,0);
+#endif
+
+  for(k = 0; k < SCAL_MAX_ENTRIES; k++)
+    {
+      if(SISFIFO_Read() == 0)
+	break;
+
+      *buf++ = LSWAP(0xb2b2b000|k);
+
+#ifdef SCAL_BLT
+      if(blt)
+	{
+	  /* DMA destination must be 64-bit aligned.  Transfer one word up
+	     if needed, and move the entry back down after masking it. */
+	  shift = ((unsigned long)buf & 0x7) ? 1 : 0;
+
+	  vmeDmaSend((unsigned long)(buf + shift), SCAL_FIFO, SCAL_NCHAN<<2);
+	  nbytes = vmeDmaDone();
+	  if(nbytes != (SCAL_NCHAN<<2))
+	    {
+	      rocErrLog(ROCERR_SCALER, roCount, k, nbytes, 0);
+	      memset(buf, 0, (SCAL_NCHAN+shift)<<2);
+	    }
+
+	  /* Data is in VME byte order; mask it with a swapped mask */
+	  for(ii = 0; ii < SCAL_NCHAN; ii++)
+	    buf[ii+shift] &= mask;
+	  if(shift)
+	    memmove(buf, buf+1, SCAL_NCHAN<<2);
+	  buf += SCAL_NCHAN;
+	}
+      else
+#endif
+	{
+	  for(ii = 0; ii < SCAL_NCHAN; ii++)
+	    *buf++ = LSWAP(Read3801(0,ii)&DATA_MASK);
+	}
+
+      *buf++ = LSWAP(0xda0000aa);
+    }
+
+#ifdef SCAL_BLT
+  if(blt)
+    vmeDmaConfig(2,5,1);
+#endif
+
+  return buf;
+}
+
+/* Scaler thread.
+   With ROC_SCALER_THREAD 1 in the usrConfig file the SIS3801 is not read
+   in rocTrigger().  A thread polls the FIFO every ROC_SCALER_PERIOD us
+   and, when it has entries, sends them as a scaler event of their own
+   (event type SCAL_EVTYPE) through rocUserEventPut().  The trigger bank
+   of a scaler event has one segment, tag SCAL_EVTYPE, holding a
+   sequence number and the TI trigger count at the time of the read, to
+   line it up with the physics events.  Bank 6 has the same format as
+   in rocTrigger().  The thread reads with single cycles and leaves the
+   DMA engine to the readout thread.  Both hold vmeBusLock() while they
+   access the bus (rocReadoutLock), so a scaler read never falls in the
+   middle of the readout of a block. */
+#define SCAL_EVTYPE   0x81  /* Scaler event type */
+#define SCAL_PERIOD   1000  /* Default poll period (us) */
+#define SCAL_NBUF     16    /* Scaler event buffers */
+#define SCAL_EVENT_BYTES (4*(2 + 1 + 2 + 3 + SCAL_MAX_ENTRIES*(SCAL_NCHAN+2) + 1))
+int scalThread=0;             /* 1: read scalers in scalerThread() */
+int scalPeriod=SCAL_PERIOD;
+static DMA_MEM_ID scalIN;
+static pthread_t scalPth;
+static volatile int scalRun=0;
+static unsigned int scalSeq=0;     /* Scaler events this run */
+static unsigned int scalNoBuf=0;   /* Reads skipped, no free buffer */
+
+/* Read the FIFO into one scaler event and queue it.  Returns the number
+   of words in the event, 0 if there was nothing to read. */
+static int
+scalerEvent()
+{
+  DMANODE *node;
+  unsigned int *buf, *start, *bank;
+
+  if(dmaPEmpty(scalIN))
+    {
+      scalNoBuf++;
+      return 0;
+    }
+
+  vmeBusLock();
+  if(!SISFIFO_Check())
+    {
+      vmeBusUnlock();
+      return 0;
+    }
+
+  node = dmaPGetItem(scalIN);
+  start = buf = (unsigned int *)&node->data[0];
+
+  /* Trigger bank: one segment with the sequence number and TI count */
+  *buf++ = LSWAP(4);
+  *buf++ = LSWAP((0xff11<<16) | (BT_SEG<<8) | 1);
+  *buf++ = LSWAP((SCAL_EVTYPE<<24) | (BT_UI4<<16) | 2);
+  *buf++ = LSWAP(scalSeq);
+  *buf++ = LSWAP(tiGetIntCount());
+
+  /* Bank 6 */
+  bank = buf;
+  buf += 2;
+  *buf++ = LSWAP(0xb0b0b0b6);
+  buf = sisReadFifo(buf, 0, 0);
+  vmeBusUnlock();
+
+  *buf++ = LSWAP(0xda0000ff);  /* Event EOB */
+  bank[0] = LSWAP(buf - bank - 1);
+  bank[1] = LSWAP((6<<16) | (BT_UI4<<8) | 0);
+
+  node->nevent = scalSeq++;
+  node->length = buf - start;
+  if(rocUserEventPut(node) != OK)
+    {
+      dmaPFreeItem(node);
+      return 0;
+    }
+
+  return node->length;
+}
+
+static void *
+scalerThread(void *arg)
+{
+  struct timespec ts;
+
+  ts.tv_sec  = scalPeriod / 1000000;
+  ts.tv_nsec = (scalPeriod % 1000000) * 1000;
+
+  while(scalRun && !ack_runend)
+    {
+      nanosleep(&ts, NULL);
+      scalerEvent();
+    }
+
+  /* Entries written up to the end of the run */
+  scalerEvent();
+  RING_STORE(rocUserActive, 0);
+
+  return NULL;
+}
+
+/* rocTrigger phases for the profiler */
+enum { PH_TI, PH_FAWAIT, PH_FADMA, PH_FAPULSE, PH_VTWAIT, PH_VTDMA, PH_SCAL, NPHASE };
+#ifdef ROC_PROFILE
+static const char *phaseName[NPHASE] =
+  { "TI", "FADC wait", "FADC DMA", "FADC pulse", "VETROC wait", "VETROC DMA", "SIS3801" };
+#endif
+
 /****************************************
  *  DOWNLOAD
  ****************************************/
 void
 rocDownload()
 {
-  int ifa, stat;
+  int ifa, stat, maxLevel;
   unsigned short faflag;
 
   /* Setup Address and data modes for DMA transfers
@@ -126,9 +430,27 @@ rocDownload()
 
   vmeDmaConfig(2,5,1);
 
-  /* Define BLock Level */
+  /* Define BLock Level, Buffer Level and Trigger Holdoff */
+
+  blockLevel  = rocConfigInt("ROC_BLOCKLEVEL", BLOCKLEVEL);
+  bufferLevel = rocConfigInt("ROC_BUFFERLEVEL", BUFFERLEVEL);
+  holdoff     = rocConfigInt("ROC_HOLDOFF", HOLDOFF);
+  rocTuneDownload(&blockLevel, &bufferLevel, &holdoff);
+
+  rocDmaAlign = rocConfigInt("ROC_DMA_ALIGN", DMA_ALIGN);
+  vtRoMode    = rocConfigInt("ROC_VETROC_ROMODE", VETROC_ROMODE);
+  vtMaxHits   = rocConfigInt("ROC_VETROC_MAX_HITS", VETROC_MAX_HITS);
+  if((vtRoMode < 0) || (vtRoMode > VETROC_ROBENCH))
+    {
+      daLogMsg("ERROR","Invalid ROC_VETROC_ROMODE %d.  Using %d", vtRoMode, VETROC_ROMODE);
+      vtRoMode = VETROC_ROMODE;
+    }
 
-  blockLevel = BLOCKLEVEL;
+  /* Block level may follow the trigger rate (ROC_BLOCK_ADAPT), not while tuning */
+  if(rocTuneActive)
+    rocAdaptOn = 0;
+  rocAdaptHook = blockLevelChange;
+  maxLevel = rocBlockLevelMax(blockLevel);
 
 
 	/*****************
@@ -140,6 +462,19 @@ rocDownload()
 		clrAllCntSIS();
 	}
 
+	scalThread = rocConfigInt("ROC_SCALER_THREAD", 0);
+	scalPeriod = rocConfigInt("ROC_SCALER_PERIOD", SCAL_PERIOD);
+	if (use_3801 && scalThread)
+	{
+		scalIN = dmaPCreate("scalIN", SCAL_EVENT_BYTES, SCAL_NBUF, 0);
+		if (scalIN == 0)
+		{
+			daLogMsg("ERROR","Unable to allocate scaler event buffers");
+			scalThread = 0;
+		}
+	}
+	rocReadoutLock = (use_3801 && scalThread);
+
 
   /*****************
    *   TI SETUP
@@ -158,6 +493,8 @@ rocDownload()
 #else
   tiSetTriggerSource(TI_TRIGGER_TSINPUTS);  //TS Inputs trigger;
 #endif
+  if(rocTuneActive)
+    tiSetTriggerSource(TI_TRIGGER_PULSER);
 
   tiFakeTriggerBankOnError(0);
 
@@ -180,7 +517,7 @@ rocDownload()
 //  tiSetTriggerHoldoff(1,11,1);	// no more than 1 triggers in 11*480ns - VETROC works (BLOCKLEVEL=8,BUFFERLEVEL=4)
 //  tiSetTriggerHoldoff(1,12,1);	// no more than 1 triggers in 12*480ns - VETROC works (BLOCKLEVEL=8,BUFFERLEVEL=4)
   // tiSetTriggerHoldoff(1,15,1);	// no more than 1 triggers in 15*480ns - VETROC works (BLOCKLEVEL=8,BUFFERLEVEL=4)
-  tiSetTriggerHoldoff(1,31,1);	// no more than 1 triggers in 31*480ns - VETROC works (BLOCKLEVEL=8,BUFFERLEVEL=4)
+  tiSetTriggerHoldoff(1,holdoff,1);	// default 31: no more than 1 triggers in 31*480ns - VETROC works (BLOCKLEVEL=8,BUFFERLEVEL=4)
 
   tiSetTriggerHoldoff(2,10,0);	// no more than 2 triggers in 10*16ns
 
@@ -188,7 +525,7 @@ rocDownload()
   tiSetBlockLevel(blockLevel);
 
   /* Set Trigger Buffer Level */
-  tiSetBlockBufferLevel(BUFFERLEVEL);
+  tiSetBlockBufferLevel(bufferLevel);
 
 	/* Enable ti data readout */
 	tiEnableDataReadout();
@@ -232,21 +569,30 @@ rocDownload()
   fadcA32Base = 0x08800000; /* Set the Base address of the FADC block data registers */
 
   vmeSetQuietFlag(1);
-  faInit(FADC_ADDR, FADC_INCR, NFADC, faflag);
+  faInit(FADC_ADDR, FADC_INCR, rocConfigInt("ROC_NFADC", NFADC), faflag);
   vmeSetQuietFlag(0);
 
   // We will set the busy out to the SD after the vetroc is added
 
-  /* Just one FADC250 */
-  faDisableMultiBlock();
+  /* More than one FADC250: pass the token through the SD so one DMA
+     reads them all */
+  faMultiBlock = (nfadc > 1) && rocConfigInt("ROC_FADC_MULTIBLOCK", FADC_MULTIBLOCK);
+  if(faMultiBlock)
+    faEnableMultiBlock(1);
+  else
+    faDisableMultiBlock();
 
   /* configure all modules based on config file */
   FADC_READ_CONF_FILE;
 
   for(ifa = 0; ifa < nfadc; ifa++)
     {
-      /* Bus errors to terminate block transfers (preferred) */
-      faEnableBusError(faSlot(ifa));
+      /* Bus errors to terminate block transfers (preferred).
+	 With the token, only the last module ends the transfer. */
+      if(faMultiBlock && (ifa < nfadc - 1))
+	faDisableBusError(faSlot(ifa));
+      else
+	faEnableBusError(faSlot(ifa));
 
       /*trigger-related*/
       faResetMGT(faSlot(ifa),1);
@@ -254,8 +600,27 @@ rocDownload()
     }
 
   faGStatus(0);
+
+  /* Reduce the raw samples to pulse parameters, all or all but 1 in N
+     blocks (ROC_FADC_PULSE, ROC_FADC_RAW_PRESCALE) */
+  rocPulseConfig();
 #endif
 
+  rocEndStuckHook = endStuck;
+
+  /* Largest block this configuration can produce, to size the event buffers */
+  rocSetEventLength(4*((8 + 5*maxLevel)                   /* TI trigger bank */
+#ifdef USE_FADC
+		       + 3 + nfadc*(2 + fadcMaxWords(maxLevel)) /* Bank 3 */
+		       + ((rocPulseMode != 0) ?                  /* Bank 8 */
+			  3 + nfadc*fadcMaxWords(maxLevel) : 0)
+#endif
+#ifdef USE_VETROC
+		       + 3 + NVETROC*(2 + vetrocBlockWords(maxLevel, vtMaxHits)) /* Bank 4 */
+#endif
+		       + 4 + SCAL_MAX_ENTRIES*(SCAL_NCHAN+2) + 1 /* Bank 6 */
+		       + 6));                               /* Bank 7 */
+
   /*****************
    *   VTP SETUP
    *****************/
@@ -290,7 +655,7 @@ rocPrestart()
   //	vtflag = 0x20;  /* FP 1  0x020;  MAY NEED TO BE CHANGED*/
   vtflag = 0x111; /* vxs sync-reset, trigger, clock */
 
-  vetrocA32Base = 0x09000000;
+  vetrocA32Base = VETROC_A32_BASE;
   nvetroc = vetrocInit((VETROC_SLOT<<19),(VETROC_SLOT_INCR<<19) , NVETROC, vtflag);
   if (nvetroc <= 0) {
     printf("ERROR: no VETROC !!! \n");
@@ -315,9 +680,9 @@ rocPrestart()
   VETROC_READ_CONF_FILE;
 
 
-#if(VETROC_ROMODE==2)
-  vetrocEnableMultiBlock();
-#endif
+  vtMultiBlock = 0;
+  if(vtRoMode == 2)
+    vetrocBlockMode(0);
 
 #endif
   /* Print status for all boards */
@@ -360,6 +725,8 @@ rocGo()
 #ifdef USE_FADC
   /* Enable/Set Block Level on modules, if needed, here */
   faGSetBlockLevel(blockLevel);
+  MAXFADCWORDS = fadcMaxWords(blockLevel);
+  printf("rocGo: FADC block transfer limit %d words\n", MAXFADCWORDS);
 
   /*  Enable FADC */
   faGEnable(0, 0);
@@ -370,10 +737,23 @@ rocGo()
 		printf("Clearing scalers \n");
 		runStartClrSIS();
 
+		if (scalThread)
+		{
+			dmaPReInit(scalIN);
+			scalSeq = scalNoBuf = 0;
+			scalRun = rocUserActive = 1;
+			if(pthread_create(&scalPth, NULL, scalerThread, NULL) != 0)
+			{
+				daLogMsg("ERROR","Unable to start scaler thread");
+				scalRun = rocUserActive = 0;
+			}
+		}
 	}
 
 #ifdef USE_VETROC
   vetrocGSetBlockLevel(blockLevel);
+  MAXVETROCDATA = vetrocBlockWords(blockLevel, vtMaxHits);
+  printf("rocGo: VETROC block transfer limit %d words\n", MAXVETROCDATA);
 #endif
 
   /* Interrupts/Polling enabled after conclusion of rocGo() */
@@ -389,6 +769,14 @@ rocGo()
 #endif
 
   tiSetBlockLimit(0);
+  rocTuneGo();
+
+  rocWaitClear(&faWait);
+  rocWaitClear(&vtWait);
+  rocDmaBenchClear();
+  rocPulseClear();
+  memset(vtModeBench, 0, sizeof(vtModeBench));
+  PROF_INIT(NPHASE, phaseName);
 
   tiStatus(1);
 }
@@ -414,9 +802,18 @@ rocEnd()
   faGDisable(0);
 #endif
 
-  /* Print status for all boards */
+  if(scalRun)
+    {
+      scalRun = 0;
+      pthread_join(scalPth, NULL);
+      printf("rocEnd: %d scaler events (%d reads skipped, no buffer)\n",
+	     scalSeq, scalNoBuf);
+    }
+
+  /* Print status for all boards
+     (full VETROC status if a block was missed during the run) */
 #ifdef USE_VETROC
-  vetrocGStatus(0);
+  vetrocGStatus(rocErrCount[ROCERR_VETROC_MISSED] ? 1 : 0);
 #endif
 #ifdef USE_FADC
   faGStatus(0);
@@ -425,7 +822,18 @@ rocEnd()
   tiStatus(1);
 
   printf("rocEnd: Ended after %d blocks\n",tiGetIntCount());
+  rocTuneEnd();
 
+#ifdef USE_FADC
+  rocWaitReport(&faWait);
+  rocPulseReport();
+#endif
+#ifdef USE_VETROC
+  rocWaitReport(&vtWait);
+  vetrocModeReport();
+#endif
+  rocDmaBenchReport();
+  PROF_REPORT;
 }
 
 /****************************************
@@ -434,15 +842,24 @@ rocEnd()
 void
 rocTrigger(int arg)
 {
-  int ii, gbready, itime, read_stat, stat;
-  int ivt = 0, ifa, nwords_fa, nwords_vt, blockError, dCnt;
-  unsigned int val;
+  int gbready, read_stat, stat;
+  int ivt = 0, ifa, nwords_fa, nwords_vt, blockError, dCnt, align, skip;
+  int romode, nread;
+  unsigned long long tdma, tvt;
+  unsigned int *bank3;
   unsigned int datascan, scanmask, roCount;
 
-  /* Set TI output 1 high for diagnostics */
-  tiSetOutputPort(1,0,0,0);
+  /* Set TI output 1 high for diagnostics, if enabled */
+  ROC_DIAG_START;
 
   roCount = tiGetIntCount(); //Get the TI trigger count
+  if(rocTuneActive)
+    rocTuneBlock();
+
+  PROF_START;
+
+  /* Pad module data to 8 bytes in this block? (ROC_DMA_ALIGN) */
+  align = rocDmaAlignBlock();
 
   /* Readout the trigger block from the TI
      Trigger Block MUST be reaodut first */
@@ -456,17 +873,12 @@ rocTrigger(int arg)
 
   dCnt = tiReadTriggerBlock(dma_dabufp);
 
+  /* Raw samples kept for this block? (ROC_FADC_RAW_PRESCALE/TYPE) */
+  rocPulseRawBlock(dma_dabufp, dCnt);
+
   if(dCnt<=0)
     {
-      printf("%d: No TI Trigger data or error.  dCnt = %d\n",roCount,dCnt);
-      for (ii = 0; ii < 10; ii++)
-	{
-	  val = *dma_dabufp++;
-	  printf(" data[%2d] = 0x%08x\n", ii, LSWAP(val));
-	}
-
-      printf("Press Enter to continue\n");
-      getchar();
+      rocErrLog(ROCERR_TI_READ, roCount, dCnt, 0, 0);
       tiSetBlockLimit(1);
     }
   else
@@ -474,32 +886,47 @@ rocTrigger(int arg)
 
       dma_dabufp += dCnt;
     }
+  PROF_MARK(PH_TI);
 
 #ifdef USE_FADC
   /* fADC250 Readout */
+  ROC_DIAG_PHASE(2);
+  bank3 = dma_dabufp;
   BANKOPEN(3,BT_UI4,blockLevel);
-  *dma_dabufp++ = LSWAP(0xb0b0b0b5); /* First word */
+  *dma_dabufp++ = LSWAP(rocDmaMarker(0xb0b0b0b5, align)); /* First word */
 
   /* Mask of initialized modules */
   scanmask = faScanMask();
-  /* Check scanmask for block ready up to 100 times */
-  datascan = faGBlockReady(scanmask, 100);
+  /* Wait for all modules in scanmask to have a block ready */
+  datascan = rocWaitReady(&faWait, faGBready, scanmask, FADC_READY_TIMEOUT);
   stat = (datascan == scanmask);
+  PROF_MARK(PH_FAWAIT);
 
   if(stat)
     {
-      for(ifa = 0; ifa < nfadc; ifa++)
+      /* Multiboard DMA reads all modules from the first, as one entry */
+      for(ifa = 0; ifa < (faMultiBlock ? 1 : nfadc); ifa++)
 	{
-	  nwords_fa = faReadBlock(faSlot(ifa), dma_dabufp + 1, MAXFADCWORDS, 1);
-	  *dma_dabufp++ = LSWAP(nwords_fa);
+	  skip = rocDmaSkip(align);
+	  nwords_fa = rocDmaLimit((faMultiBlock ? nfadc : 1)*MAXFADCWORDS,
+				  DMA_RESERVE + skip, roCount, faSlot(ifa));
+	  tdma = rocTimeNs();
+	  if(nwords_fa > 0)
+	    nwords_fa = faReadBlock(faSlot(ifa), dma_dabufp + skip, nwords_fa,
+				    faMultiBlock ? 2 : 1);
+	  else if(rocDropBuf)  /* No room: empty the modules, drop the block */
+	    faReadBlock(faSlot(ifa), rocDropBuf, (faMultiBlock ? nfadc : 1)*MAXFADCWORDS,
+			faMultiBlock ? 2 : 1);
+	  rocDmaBench(dma_dabufp + skip, nwords_fa, tdma);
+	  rocDmaCount(nwords_fa, skip);
+	  rocPulseAdd(dma_dabufp, nwords_fa);
 
 	  /* Check for ERROR in block read */
 	  blockError = faGetBlockError(1);
 
 	  if(blockError)
 	    {
-	      printf("ERROR: Slot %d: in transfer (event = %d), nwords = 0x%x\n",
-		     faSlot(ifa), roCount, nwords_fa);
+	      rocErrLog(ROCERR_BLOCK, roCount, faSlot(ifa), nwords_fa, 0);
 
 	      if(nwords_fa > 0)
 		dma_dabufp += nwords_fa;
@@ -512,62 +939,79 @@ rocTrigger(int arg)
     }
   else
     {
-      printf("ERROR: Event %d: Datascan != Scanmask  (0x%08x != 0x%08x)\n", roCount, datascan, scanmask);
+      rocErrLog(ROCERR_DATASCAN, roCount, datascan, scanmask, 0);
     }
   BANKCLOSE;
+  PROF_MARK(PH_FADMA);
+
+  /* Pulse parameters of the raw samples, with or in place of bank 3 */
+  rocPulseBank(bank3, blockLevel, DMA_RESERVE);
+  PROF_MARK(PH_FAPULSE);
 #endif
 
 #ifdef USE_VETROC
   /* Bank for VETROC data */
+  ROC_DIAG_PHASE(3);
   BANKOPEN(4,BT_UI4,0);
-  *dma_dabufp++ = LSWAP(0xb0b0b0b4); /* First word */
+  *dma_dabufp++ = LSWAP(rocDmaMarker(0xb0b0b0b4, align)); /* First word */
   dCnt = 0;
 
   /* Check for valid data in VETROC */
   read_stat = 0;
 
-  for(itime=0; itime<1000; itime++)
-    {
-      gbready = vetrocGBready();
-      read_stat = (gbready == vetrocSlotMask);
-
-      if (read_stat>0)
-	{
-	  break;
-	}
-    }
+  gbready = rocWaitReady(&vtWait, vetrocGBready, vetrocSlotMask,
+			 VETROC_READY_TIMEOUT);
+  read_stat = (gbready == vetrocSlotMask);
+  PROF_MARK(PH_VTWAIT);
 
   if(read_stat>0)
     { /* read the data here */
-#if(VETROC_ROMODE==2)
-      ivt = 0;
-#else
-      for(ivt=0; ivt<nvetroc; ivt++)
-#endif
-	{
-	  /* skip 1 word so nwords_vt is written before buffer to keep same format as before */
-	  nwords_vt = vetrocReadBlock(vetrocSlot(ivt), dma_dabufp + 1,
-				      MAXVETROCDATA, VETROC_ROMODE);
-	  *dma_dabufp++ = LSWAP(nwords_vt);
+      romode = vetrocBlockMode(roCount);
+      /* MultiBoard DMA reads all boards with the first */
+      nread = (romode == 2) ? 1 : nvetroc;
+      tvt = rocTimeNs();
 
-          dma_dabufp+= nwords_vt;
+      for(ivt=0; ivt<nread; ivt++)
+	{
+	  /* skip 1 word (2 if padded) so nwords_vt is written before buffer to keep same format as before */
+	  skip = rocDmaSkip(align);
+	  nwords_vt = rocDmaLimit((nvetroc/nread)*MAXVETROCDATA, DMA_RESERVE + skip,
+				  roCount, vetrocSlot(ivt));
+	  tdma = rocTimeNs();
+	  if(nwords_vt > 0)
+	    nwords_vt = vetrocReadBlock(vetrocSlot(ivt), dma_dabufp + skip,
+					nwords_vt, romode);
+	  else if(rocDropBuf)  /* No room: empty the boards, drop the block */
+	    vetrocReadBlock(vetrocSlot(ivt), rocDropBuf, (nvetroc/nread)*MAXVETROCDATA,
+			    romode);
+	  rocDmaBench(dma_dabufp + skip, nwords_vt, tdma);
+	  rocDmaCount(nwords_vt, skip);
+
+	  if(nwords_vt > 0)
+	    {
+	      vtModeBench[romode].words += nwords_vt;
+	      dma_dabufp += nwords_vt;
+	    }
+	  else
+	    vtModeBench[romode].errors++;
 	}
+      vtModeBench[romode].blocks++;
+      vtModeBench[romode].ns += rocTimeNs() - tvt;
     }
   else
     {
-      printf("Missed VETROC event data: gbready=0x%08X, vetrocSlotMask=0x%08X\n", gbready, vetrocSlotMask);
-      fflush(stdout);
+      rocErrLog(ROCERR_VETROC_MISSED, roCount, gbready, vetrocSlotMask, 0);
       tiSetBlockLimit(1);
-      vetrocGStatus(1);
     }
   BANKCLOSE;
+  PROF_MARK(PH_VTDMA);
 #endif
 
 	/* Scaler readout */
-	if (use_3801)
+	ROC_DIAG_PHASE(4);
+	if (use_3801 && !scalThread)
 	{	
 		BANKOPEN(6,BT_UI4,0);
-		int k=0;
 
 //SISFIFO_start(); //what is this one for?
 //				if(SISFIFO_Check()||tiGetIntCount()==2) //why is this necessary?
@@ -575,36 +1019,22 @@ rocTrigger(int arg)
 		{
 			*dma_dabufp++ = LSWAP(0xb0b0b0b6);
 
-			for (k=0; k<1; k++)
-			{
-				int not_empty=SISFIFO_Read();
-//							printf("3801 empty or not? %d\n", not_empty); 
-				if(not_empty==0) break;
-				else 
-				{
-					*dma_dabufp++ = LSWAP(0xb2b2b000|k);
-//						*dma_dabufp++ = LSWAP(Read3801(0,0)&0xc0000000);
-
-					for (ii=0; ii<32; ii++)
-					{
-							*dma_dabufp++ = LSWAP( Read3801(0,ii)&DATA_MASK);
-//								*dma_dabufp++ = LSWAP( Read3801(0,ii));
-					}
-					*dma_dabufp++ = LSWAP(0xda0000aa);
-/*								*dma_dabufp++ = LSWAP((Read3801(0,0)&UPBIT_MASK)>>24);
-								*dma_dabufp++ = LSWAP((Read3801(0,0)&QRT_MASK)>>31);
-								*dma_dabufp++ = LSWAP((Read3801(0,0)&HELICITY_MASK)>>30);
-*/			}
-			}
+			dma_dabufp = sisReadFifo(dma_dabufp, 1, roCount);
+/*			*dma_dabufp++ = LSWAP((Read3801(0,0)&UPBIT_MASK)>>24);
+			*dma_dabufp++ = LSWAP((Read3801(0,0)&QRT_MASK)>>31);
+			*dma_dabufp++ = LSWAP((Read3801(0,0)&HELICITY_MASK)>>30);
+*/
 		}
 
 		*dma_dabufp++ = LSWAP(0xda0000ff);  /* Event EOB */
 		BANKCLOSE;
 
 	}
+  PROF_MARK(PH_SCAL);
+  PROF_STOP;
 
-  /* Set TI output 0 low */
-  tiSetOutputPort(0,0,0,0);
+  /* Set TI outputs low */
+  ROC_DIAG_STOP;
 
 }
 